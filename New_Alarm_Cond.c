@@ -1,377 +1,6142 @@
-/*
- * alarm_cond.c
- *
- * This is an enhancement to the alarm_mutex.c program, which
- * used only a mutex to synchronize access to the shared alarm
- * list. This version adds a condition variable. The alarm
- * thread waits on this condition variable, with a timeout that
- * corresponds to the earliest timer request. If the main thread
- * enters an earlier timeout, it signals the condition variable
- * so that the alarm thread will wake up and process the earlier
- * timeout first, requeueing the later request.
- */
-#include <pthread.h>
-#include <time.h>
-#include "errors.h" // for handling errors
-#include <string.h>
-#include <stdlib.h>
-
-/*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
- */
-typedef struct alarm_tag
-{
-    int alarm_id;           // identifier for the alarm
-    struct alarm_tag *link; // pointer to the next alarm
-    int seconds;            // time in seconds for periodic alarms
-    time_t scheduled_time;  // time for the scheduled alarms
-    char message[100];
-} alarm_t;
-
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-alarm_t *Alarm_Display_List = NULL;
-pthread_mutex_t alarm_display_list_mutex = PTHREAD_MUTEX_INITIALIZER; // mutex for guiding access for the alarm display list
-time_t current_alarm = 0;
-void *periodic_display_thread(void *arg);
-
-// Alarm system initialization
-void initialize_alarm_system()
-{
-    int status;
-
-    // Alarm Display List initialization
-    Alarm_Display_List = NULL; // Start empty
-    // then
-    status = pthread_mutex_init(&alarm_display_list_mutex, NULL); // initialize the mutex
-    if (status != 0)
-    {
-        err_abort(status, "Initializing alarm display list mutex");
-    }
-}
-
-/*
- * Insert alarm entry on list, in order.
- */
-void alarm_insert(alarm_t *alarm)
-{
-    int status;
-    alarm_t **last, *next;
-
-    /*
-     * LOCKING PROTOCOL:
-     *
-     * This routine requires that the caller have locked the
-     * alarm_mutex!
-     */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL)
-    {
-        if (next->scheduled_time >= alarm->scheduled_time)
-        {
-            alarm->link = next;
-            *last = alarm;
-            break;
-        }
-        last = &next->link;
-        next = next->link;
-    }
-    /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
-     */
-    if (next == NULL)
-    {
-        *last = alarm;
-        alarm->link = NULL;
-    }
-#ifdef DEBUG
-    printf("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
-        printf("%d(%d)[\"%s\"] ", next->time,
-               next->time - time(NULL), next->message);
-    printf("]\n");
-#endif
-    /*
-     * Wake the alarm thread if it is not busy (that is, if
-     * current_alarm is 0, signifying that it's waiting for
-     * work), or if the new alarm comes before the one on
-     * which the alarm thread is waiting.
-     */
-    if (current_alarm == 0 || alarm->scheduled_time < current_alarm)
-    {
-        current_alarm = alarm->scheduled_time;
-        status = pthread_cond_signal(&alarm_cond);
-        if (status != 0)
-            err_abort(status, "Signal cond");
-    }
-}
-
-
-void change_alarm(int alarm_id, int time, char *message)
-{
-    int status;
-    alarm_t *alarm, *prev = NULL;
-
-    status = pthread_mutex_lock(&alarm_mutex);
-    if (status != 0)
-        err_abort(status, "Lock mutex");
-
-    for (alarm = alarm_list; alarm != NULL; alarm = alarm->link)
-    {
-        if (alarm->alarm_id == alarm_id)
-            break;
-        prev = alarm;
-    }
-
-    if (alarm != NULL)
-    {
-        alarm->seconds = time;
-        alarm->scheduled_time = time(NULL) + time;
-        strncpy(alarm->message, message, sizeof(alarm->message) - 1);
-
-        if (prev != NULL)
-            prev->link = alarm->link;
-        else
-            alarm_list = alarm->link;
-        alarm_insert(alarm);
-    }
-
-    status = pthread_mutex_unlock(&alarm_mutex);
-    if (status != 0)
-        err_abort(status, "Unlock mutex");
-}
-
-
-void cancel_alarm(int alarm_id)
-{
-    int status;
-    alarm_t *alarm, *prev = NULL;
-
-    status = pthread_mutex_lock(&alarm_mutex);
-    if (status != 0)
-        err_abort(status, "Lock mutex");
-
-    for (alarm = alarm_list; alarm != NULL; alarm = alarm->link)
-    {
-        if (alarm->alarm_id == alarm_id)
-            break;
-        prev = alarm;
-    }
-
-    if (alarm != NULL)
-    {
-        if (prev != NULL)
-            prev->link = alarm->link;
-        else
-            alarm_list = alarm->link;
-        free(alarm);
-    }
-
-    status = pthread_mutex_unlock(&alarm_mutex);
-    if (status != 0)
-        err_abort(status, "Unlock mutex");
-}
-
-
-/*
- * The alarm thread's start routine.
- */
-void *alarm_thread(void *arg)
-{
-    alarm_t *alarm;
-    struct timespec cond_time;
-    time_t now;
-    int status, expired;
-
-    /*
-     * Loop forever, processing commands. The alarm thread will
-     * be disintegrated when the process exits. Lock the mutex
-     * at the start -- it will be unlocked during condition
-     * waits, so the main thread can insert alarms.
-     */
-    status = pthread_mutex_lock(&alarm_mutex);
-    if (status != 0)
-        err_abort(status, "Lock mutex");
-    while (1)
-    {
-        /*
-         * If the alarm list is empty, wait until an alarm is
-         * added. Setting current_alarm to 0 informs the insert
-         * routine that the thread is not busy.
-         */
-        current_alarm = 0;
-        while (alarm_list == NULL)
-        {
-            status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
-            if (status != 0)
-                err_abort(status, "Wait on cond");
-        }
-        alarm = alarm_list;
-        alarm_list = alarm->link;
-        now = time(NULL);
-        expired = 0;
-        if (alarm->scheduled_time > now)
-        {
-#ifdef DEBUG
-            printf("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                   alarm->time - time(NULL), alarm->message);
-#endif
-            cond_time.tv_sec = alarm->scheduled_time;
-            cond_time.tv_nsec = 0;
-            current_alarm = alarm->scheduled_time;
-            while (current_alarm == alarm->scheduled_time)
-            {
-                status = pthread_cond_timedwait(
-                    &alarm_cond, &alarm_mutex, &cond_time);
-                if (status == ETIMEDOUT)
-                {
-                    expired = 1;
-                    break;
-                }
-                if (status != 0)
-                    err_abort(status, "Cond timedwait");
-            }
-            if (!expired)
-                alarm_insert(alarm);
-        }
-        else
-            expired = 1;
-        if (expired)
-        {
-            printf("(%d) %s\n", alarm->seconds, alarm->message);
-            free(alarm);
-        }
-    }
-}
-
-int main(int argc, char *argv[])
-{
-    int status;
-    char line[128];
-    alarm_t *alarm;
-    pthread_t thread;
-
-    status = pthread_create(
-        &thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort(status, "Create alarm thread");
-    while (1)
-    {
-        printf("Alarm> ");
-        if (fgets(line, sizeof(line), stdin) == NULL)
-            exit(0);
-        if (strlen(line) <= 1)
-            continue;
-        alarm = (alarm_t *)malloc(sizeof(alarm_t));
-        if (alarm == NULL)
-            errno_abort("Allocate alarm");
-
-        /*
-         * Parse input line into seconds (%d) and a message
-         * (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
-         */
-        if (sscanf(line, "%d %64[^\n]",
-                   &alarm->seconds, alarm->message) < 2)
-        {
-            fprintf(stderr, "Bad command\n");
-            free(alarm);
-        }
-        else
-        {
-            status = pthread_mutex_lock(&alarm_mutex);
-            if (status != 0)
-                err_abort(status, "Lock mutex");
-            alarm->scheduled_time = time(NULL) + alarm->seconds;
-            /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by expiration time.
-             */
-            alarm_insert(alarm);
-            status = pthread_mutex_unlock(&alarm_mutex);
-            if (status != 0)
-                err_abort(status, "Unlock mutex");
-        }
-    }
-}
-
-/// IMPLEMENTATION TODO
-
-// IMPLEMENT CONSUMER THREAD HERE
-void *consumer_thread(void *arg)
-{
-}
-
-extern alarm_t *Alarm_Display_List;
-extern pthread_mutex_t alarm_display_list_mutex;
-
-// IMPLEMENT PERDIODIC DISPLAY THREAD HERE
-void *periodic_display_thread(void *arg)
-{
-    alarm_t *temp;
-    while (1)
-    {
-        // Lock the mutex for safe access to the alarm display list
-        int status = pthread_mutex_lock(&alarm_display_list_mutex);
-        if (status != 0)
-        {
-            err_abort(status, "Lock alarm display list mutex"); // locking
-        }
-
-        // Go through the alarm display list
-        // to find alarms that should be dislayed now(time)
-        time_t now = time(NULL);
-        time_t next_alarm_time = now + 60;
-        alarm_t *temp = Alarm_Display_List;
-        while (temp != NULL)
-        {
-            if (temp->scheduled_time <= now)
-            {
-                printf("ALARM MESSAGE (%d) PRINTED BY ALARM DISPLAY THREAD: TIME = %ld MESSAGE = %s\n",
-                       temp->alarm_id, (long)temp->scheduled_time, temp->message);
-                // If the alarm is periodic , reschedule it.
-                temp->scheduled_time += temp->seconds; // Adjusting for periodic alarms.
-            }
-            // Find the earliest next alarm time to optimize sleep duration.
-            if (temp->scheduled_time < next_alarm_time)
-            {
-                next_alarm_time = temp->scheduled_time;
-            }
-            temp = temp->link;
-        }
-
-        status = pthread_mutex_unlock(&alarm_display_list_mutex);
-        if (status != 0)
-            err_abort(status, "Unlock alarm display list mutex");
-
-        // Sleep until the next alarm time or a maximum of 60 seconds.
-        time_t sleep_time = next_alarm_time - time(NULL);
-        sleep_time = (sleep_time > 0) ? sleep_time : 1; // Ensure it sleeps at least 1 second.
-        sleep(sleep_time);
-    }
-
-    return NULL;
-}
-
-/*// IMPLEMENT CIRCULAR BUFFER: DATA STRUCTURE BETWEEN THE ALARM THREAD AND CONSUMER THREAD
-typedef struct circular_buffer
-{
-
-
-}
-
-// IMPLEMENT Alarm_Display_List, DATASTRUCTURE BETWEEN THE CONSUMER THREAD AND PERIODIC DISPLAY THREAD
-typedef struct alram_display_list
-{
-}
-
-// IMPLEMENT A FUNCTION TO PROCESS THE ALARM REQUEST
-*/
+/*
+ * alarm_cond.c
+ *
+ * This is an enhancement to the alarm_mutex.c program, which
+ * used only a mutex to synchronize access to the shared alarm
+ * list. This version adds a condition variable. The alarm
+ * thread waits on this condition variable, with a timeout that
+ * corresponds to the earliest timer request. If the main thread
+ * enters an earlier timeout, it signals the condition variable
+ * so that the alarm thread will wake up and process the earlier
+ * timeout first.
+ *
+ * Pending alarms are kept in an "alarm store". The store has three
+ * backends, selected with "-b" on the command line: the original
+ * sorted list ("list"), a hierarchical timing wheel ("wheel", the
+ * default) with O(1) insert and expiry, and a 4-ary min-heap
+ * ("heap"). Whatever the backend, the store indexes alarms by
+ * alarm_id in a hash table, so change and cancel never scan.
+ *
+ * When an alarm expires, the alarm thread hands it to the consumer
+ * thread through a lock-free circular buffer ("-r" chooses what
+ * happens when it is full). The consumer passes it on to a
+ * work-stealing pool of "-x" executor threads (default 1), which run
+ * its action (by default, printing it), then move periodic alarms to
+ * a display list, a heap ordered by next display time, where a
+ * periodic display thread shows them again every "delay" on a fixed,
+ * drift-free grid. Periodic alarms are split by alarm_id among "-p"
+ * display threads (default 1), and the executor hands them over
+ * without taking their locks. How periods missed by a late display
+ * thread are made up is chosen with "-c": skip them, coalesce them
+ * into one display (the default), or burst through all of them.
+ *
+ * The alarms are split into shards by a hash of alarm_id ("-n",
+ * default one per online CPU). Each shard has its own store,
+ * mutex, condition variable and alarm thread, so inserts for
+ * different shards never contend. That is how producers scale;
+ * the store itself stays under its shard's mutex, which also
+ * orders the id index, the log and the alarm thread's wakeups, so
+ * a lock-free store would still have to take it.
+ *
+ * The alarm threads have two engines, selected with "-e": "cond"
+ * (the default) sleeps in pthread_cond_timedwait, and "epoll"
+ * arms a timerfd to the earliest deadline and sleeps in
+ * epoll_wait, so other file descriptors can share its loop.
+ * Either can spin for the last stretch before a deadline, rather
+ * than trust the kernel to wake it on time: "-e engine:window"
+ * blocks until "window" before each deadline and spins the rest,
+ * and "-e engine:adaptive" tunes the window from how late the
+ * thread's wakeups actually are.
+ *
+ * Threads go wherever the scheduler puts them unless "-a role:cpus"
+ * pins a role (timer, consumer, display, executor or writer) to a
+ * CPU list such as "0-3,6", one CPU per thread; "-a consumer:sibling"
+ * puts the consumer on the timer CPUs' hyperthread siblings, and
+ * "-P priority" runs the alarm threads SCHED_FIFO if permitted.
+ * Where each thread ended up is reported at startup.
+ *
+ * All times are nanoseconds on CLOCK_MONOTONIC, so alarms neither
+ * round to whole seconds nor move when the wall clock is set.
+ *
+ * Nothing but the writer thread writes alarms to stdout: other
+ * threads format into chunks of their own and queue them, so no
+ * scheduler lock is ever held while stdout blocks ("-o" chooses
+ * whether a full output queue blocks or drops).
+ *
+ * Counters for pending alarms, alarm thread wakeups, requeues and
+ * firing lateness are always kept; "-s" adds mutex wait and hold
+ * times. "Stats" or SIGUSR1 prints them all.
+ *
+ * With "-d dir", pending alarms survive a restart: every change is
+ * appended to a group-committed log in dir, which is folded into a
+ * snapshot from time to time, and startup recovers from both.
+ *
+ * Alarms come from per-thread slab pools rather than malloc, so
+ * steady-state churn makes no allocator calls.
+ *
+ * Each alarm has a slack: its deadline is rounded up to a multiple
+ * of it, so alarms due close together share a deadline and the
+ * alarm thread fires them in one pass and one wakeup. "-w" sets
+ * the default (0, exact); "<delay>~<slack>" sets it per alarm.
+ *
+ * Commands (a delay is a number with an optional fraction and an
+ * optional unit of s, ms, us or ns, such as 2, 1.5s or 250ms, and
+ * an optional "~<slack>", such as 250ms~10ms):
+ *   <delay> <message>                new alarm; prints its id
+ *   Periodic <delay> <message>       new alarm, redisplayed periodically
+ *   Change <id> <delay> <message>    reschedule an alarm
+ *   Cancel <id>                      remove an alarm
+ *   Cancel range <from> <to> [<prefix>]
+ *                                    remove the alarms due between two
+ *                                    delays from now ("*" for no bound)
+ *                                    whose messages start with prefix
+ *   Shift range <from> <to> <by> [<prefix>]
+ *                                    move those alarms by a delay
+ *                                    (earlier if it starts with "-",
+ *                                    but not before now); as with
+ *                                    Change, a periodic alarm that
+ *                                    has fired is not moved
+ *   List range <from> <to> [<prefix>]
+ *                                    show those alarms, in due order
+ *                                    (the window is found through an
+ *                                    index, but the prefix is matched
+ *                                    alarm by alarm, so "* * <prefix>"
+ *                                    checks every alarm)
+ *   Pool                             show alarm pool counters
+ *   Stats                            show all counters, as "stat <name> <value>"
+ *
+ * "-f file" first reads commands from the file ("-" for stdin)
+ * without prompting, committing new alarms to each shard in
+ * batches, which is how large alarm sets are seeded.
+ *
+ * "-t trace" replays a trace of commands, each stamped with a time
+ * ("@<time> <command>"), on a virtual clock that jumps from one
+ * command or deadline to the next, so hours of alarms replay in
+ * moments and the output can be diffed; "-T trace" records the
+ * commands typed at the prompt as such a trace. Replays are only
+ * comparable under the same backend (see simulate()).
+ *
+ * "-u path" also takes commands from clients of a Unix-domain
+ * socket at path, which get a reply line per command and, after
+ * "Subscribe", a line each time one of their own alarms fires. The
+ * program then keeps running when stdin ends.
+ */
+#define _GNU_SOURCE // sem_clockwait
+#include <pthread.h>
+#include <time.h>
+#include "errors.h" // for handling errors
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+/*
+ * Times, in nanoseconds on CLOCK_MONOTONIC.
+ */
+typedef int64_t alarm_time_t;
+#define NSEC_PER_SEC 1000000000LL
+
+/*
+ * The "alarm" structure now contains the monotonic time at which
+ * each alarm is due, so that they can be sorted. Storing the
+ * requested delay would not be enough, since the "alarm thread"
+ * cannot tell how long it has been in the store.
+ *
+ * Alarms are cache-line aligned, and everything a store walks or
+ * compares (the deadline, id, links and backend position) is in
+ * the first line, so a scan touches one line per alarm. What is
+ * only used once it fires, above all the message, comes after.
+ */
+#define CACHE_LINE 64
+
+/*
+ * An interned message (see message_intern()): one copy of each
+ * distinct text, shared by every alarm that shows it.
+ */
+typedef struct message_tag
+{
+    struct message_tag *next; // hash chain; the stripe's mutex
+    atomic_long refs;         // alarms and server notes holding it
+    uint32_t hash;
+    uint32_t length;
+    char text[];              // NUL-terminated
+} message_t;
+
+struct alarm_pool_tag;
+
+typedef struct alarm_tag
+{
+    _Alignas(CACHE_LINE) alarm_time_t scheduled_time; // time for the scheduled alarms
+    struct alarm_tag *link; // pointer to the next alarm
+    struct alarm_tag *prev; // pointer to the previous alarm (wheel slots only)
+    int alarm_id;           // identifier for the alarm
+    int slot;               // backend position: wheel slot or heap index
+    alarm_time_t interval;  // requested delay; the period of periodic alarms
+    alarm_time_t slack;     // deadlines round up to a multiple; 0 = exact
+    int periodic;           // nonzero: keep displaying after it fires
+    alarm_time_t fired_time;     // when the alarm thread expired it
+    int64_t owner;               // server client to notify (see server_notify()); 0 if none
+    void (*action)(struct alarm_tag *alarm); // run by an executor worker when it fires
+    struct alarm_pool_tag *pool; // pool the alarm returns to when freed
+    message_t *message;          // interned; a reference the alarm holds
+} alarm_t;
+
+/*
+ * Timing wheel geometry. A tick is 2^16ns (about 65us); alarms
+ * are rounded up to a whole tick, so the wheel never fires one
+ * early. A slot on level n covers WHEEL_SIZE^n ticks, so five
+ * levels of 64 slots reach 2^30 ticks (about 19.5 hours) ahead.
+ * Alarms further out than that wait on the overflow list until
+ * the top level wraps around.
+ */
+#define WHEEL_TICK_SHIFT 16
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_OVERFLOW (-1) // slot of alarms on the overflow list
+#define WHEEL_EXPIRED (-2)  // slot of alarms on the expired list
+
+typedef struct timing_wheel_tag
+{
+    int64_t current;                         // next tick to be processed
+    alarm_t *slot[WHEEL_LEVELS][WHEEL_SIZE]; // doubly linked slot lists
+    uint64_t occupied[WHEEL_LEVELS];         // one bit per non-empty slot
+    alarm_t *overflow;                       // alarms beyond the top level
+    alarm_t *expired, *expired_tail;         // due alarms, in firing order
+} timing_wheel_t;
+
+/*
+ * Number of children per heap node. A 4-ary heap is half as deep
+ * as a binary one. The deadlines are kept apart from the alarms,
+ * in key[], which is laid out so that each node's children are
+ * one aligned group of four keys: half a cache line, compared
+ * without touching an alarm (heap_min_child() assumes four).
+ */
+#define HEAP_ARITY 4
+#define HEAP_KEY_PAD (HEAP_ARITY - 1) // unused keys before key[0]
+
+typedef struct alarm_heap_tag
+{
+    alarm_t **node;     // node[0] is the earliest alarm
+    alarm_time_t *key;  // key[i] is node[i]'s scheduled_time; INT64_MAX past size
+    size_t size;        // number of alarms in the heap
+    size_t capacity;    // allocated length of node[]
+} alarm_heap_t;
+
+/*
+ * Open-addressed hash table from alarm_id to alarm, with linear
+ * probing. The table doubles whenever it gets half full. Each
+ * bucket holds the id beside the alarm pointer, so a probe reads
+ * only the table, and touches an alarm only once it has found it.
+ */
+typedef struct index_bucket_tag
+{
+    int alarm_id;   // 0 marks an empty bucket
+    alarm_t *alarm;
+} index_bucket_t;
+
+typedef struct alarm_index_tag
+{
+    index_bucket_t *bucket;
+    size_t mask;            // number of buckets - 1
+    size_t count;           // number of alarms indexed
+} alarm_index_t;
+
+typedef struct alarm_store_tag alarm_store_t;
+
+/*
+ * Operations every store backend provides. The caller must hold
+ * the owning shard's mutex for all of them; the store wrappers
+ * below keep the id index, the time-range index and store->count.
+ *
+ * reschedule() moves an alarm already in the store to a new
+ * scheduled_time. expire() unlinks and returns one alarm that is
+ * due at "now", or NULL. next_deadline() returns a time at or
+ * before the earliest pending alarm; the alarm thread sleeps
+ * until then.
+ */
+typedef struct alarm_backend_tag
+{
+    const char *name;
+    void (*init)(alarm_store_t *store);
+    void (*insert)(alarm_store_t *store, alarm_t *alarm);
+    void (*remove)(alarm_store_t *store, alarm_t *alarm);
+    void (*reschedule)(alarm_store_t *store, alarm_t *alarm, alarm_time_t when);
+    alarm_t *(*expire)(alarm_store_t *store, alarm_time_t now);
+    alarm_time_t (*next_deadline)(alarm_store_t *store);
+} alarm_backend_t;
+
+/*
+ * A node of a store's time-range index (see range_insert()): up to
+ * RANGE_ORDER entries, sorted by (time, id). A leaf's entries are
+ * alarms; an inner node's are children, each keyed by a lower
+ * bound of its subtree (the first child's key is not kept).
+ */
+#define RANGE_ORDER 32 // entries a node
+#define RANGE_MERGE 24 // siblings merge when they fit in this many
+#define RANGE_DEPTH 16 // enough for any tree: siblings hold RANGE_MERGE entries between them
+
+typedef struct range_node_tag
+{
+    _Alignas(CACHE_LINE) alarm_time_t time[RANGE_ORDER];
+    int id[RANGE_ORDER];
+    void *item[RANGE_ORDER]; // leaf: alarm_t *; inner: range_node_t *
+    int count;
+    int leaf;
+    struct range_node_tag *next; // on the store's spare list
+} range_node_t;
+
+struct alarm_store_tag
+{
+    const alarm_backend_t *backend;
+    int count;            // number of pending alarms
+    alarm_index_t index;  // alarm_id -> alarm
+    alarm_t *list;        // "list" backend, sorted by scheduled_time
+    timing_wheel_t wheel; // "wheel" backend
+    alarm_heap_t heap;    // "heap" backend
+    range_node_t *range;       // time-range index; NULL until the first alarm
+    range_node_t *range_spare; // free index nodes, kept for reuse
+};
+
+/*
+ * Circular buffer between the alarm thread and the consumer thread.
+ *
+ * With one producer it is a single-producer/single-consumer ring:
+ * each side owns one index, and keeps a cached copy of the other
+ * side's index so it only reads the shared one when the cached
+ * copy says the ring is full (or empty). With several producers it
+ * is a bounded multi-producer/single-consumer queue: producers
+ * claim a run of slots by compare-and-swap on tail, and each slot
+ * carries a sequence number that says whether it is free, or
+ * filled for the consumer's current lap.
+ *
+ * The indexes live on separate cache lines so the producer and
+ * the consumer do not keep stealing each other's line. Neither
+ * path takes a lock; the semaphore is only touched when the
+ * consumer has run out of work and gone to sleep.
+ *
+ * What an alarm thread does when the buffer is full is its
+ * backpressure policy ("-r"):
+ *   block[:timeout]  wait on the "space" semaphore, which the
+ *                    consumer posts as it frees slots, for at most
+ *                    timeout (default forever), then drop the rest;
+ *                    the shard stays unlocked meanwhile, so inserts
+ *                    into it go on
+ *   drop-newest      drop the alarms that do not fit
+ *   drop-oldest      take the oldest alarms out of the buffer, as
+ *                    the consumer would, and drop them to make room
+ *   spill            push what does not fit onto an unbounded
+ *                    lock-free overflow list, which the consumer
+ *                    drains, in order, once the ring is empty
+ * A dropped alarm loses only that firing: its action does not run,
+ * but a periodic alarm goes on to its display list as usual. Taking
+ * from the buffer as well as the consumer makes drop-oldest always
+ * use the multi-producer protocol, whose slot sequence numbers also
+ * let several threads take safely.
+ */
+#define BUFFER_SLOTS 4096   // power of two
+#define BUFFER_SPIN 1000    // empty polls before the consumer sleeps
+#define CONSUMER_BATCH 64   // alarms taken from the buffer at once
+
+#define BUFFER_BLOCK 0
+#define BUFFER_DROP_NEWEST 1
+#define BUFFER_DROP_OLDEST 2
+#define BUFFER_SPILL 3
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() sched_yield()
+#endif
+
+typedef struct buffer_slot_tag
+{
+    atomic_size_t seq; // multi-producer mode only
+    alarm_t *alarm;
+} buffer_slot_t;
+
+typedef struct circular_buffer
+{
+    _Alignas(CACHE_LINE) atomic_size_t tail; // next slot to fill
+    size_t head_cache;                       // producer's copy of head
+    _Alignas(CACHE_LINE) atomic_size_t head; // next slot to drain
+    size_t tail_cache;                       // consumer's copy of tail
+    _Alignas(CACHE_LINE) buffer_slot_t *slot;
+    size_t mask;          // number of slots - 1
+    int multi_producer;   // nonzero: MPSC protocol
+    atomic_int sleeping;  // consumer is (about to be) in sem_wait
+    sem_t wakeup;
+    atomic_int waiting;   // producers (about to be) blocked for room
+    sem_t space;
+    _Atomic(alarm_t *) spill; // overflow, newest first, linked by "link"
+    alarm_t *unspilled;       // consumer's share of the overflow, oldest first
+    atomic_long full;         // times a producer found the buffer full
+    atomic_long stalled;      // ns producers spent blocked for room
+    atomic_long timeouts;     // blocks that gave up
+    atomic_long dropped;      // firings dropped, by any policy
+    atomic_long spilled;      // alarms put on the overflow list
+} circular_buffer_t;
+
+int buffer_policy = BUFFER_BLOCK;
+alarm_time_t buffer_timeout; // "-r block:<timeout>"; 0 waits forever
+
+/*
+ * Per-thread alarm pool. A thread allocates from its own free list
+ * without locking, refilling it from alarms other threads have
+ * returned, and only then from a fresh slab of ALARM_SLAB alarms.
+ * An alarm freed by another thread (the consumer, usually) is
+ * pushed onto its owning pool's "remote" stack; the owner takes the
+ * whole stack at once, so the push needs no protection from ABA.
+ * Pools are never freed, so a late return to a pool whose thread
+ * has exited is still safe.
+ */
+#define ALARM_SLAB 256
+
+typedef struct alarm_pool_tag
+{
+    alarm_t *free_list;                             // owner thread only
+    _Alignas(CACHE_LINE) _Atomic(alarm_t *) remote; // returned by other threads
+} alarm_pool_t;
+
+static __thread alarm_pool_t *alarm_pool; // this thread's pool
+atomic_long pool_size;       // alarms carved from slabs so far
+atomic_long pool_slabs;      // slabs allocated so far
+atomic_long pool_in_use;     // alarms allocated and not yet freed
+atomic_long pool_high_water; // most alarms ever in use at once
+
+/*
+ * The message intern table, split by hash into MESSAGE_STRIPES
+ * stripes, each a chained hash table under its own mutex, so that
+ * threads creating alarms rarely wait on one another.
+ */
+#define MESSAGE_STRIPES 16
+
+typedef struct message_stripe_tag
+{
+    _Alignas(CACHE_LINE) pthread_mutex_t mutex;
+    message_t **bucket; // chains; NULL until first used
+    size_t mask;        // number of buckets - 1
+    size_t count;       // messages in the stripe
+} message_stripe_t;
+
+message_stripe_t message_stripes[MESSAGE_STRIPES];
+atomic_long message_count;   // distinct messages interned
+atomic_long message_bytes;   // their text, including the NULs
+atomic_long message_interns; // message_intern() calls
+atomic_long message_shared;  // ... that found the message already there
+
+/*
+ * A file descriptor watched by an "epoll" engine event loop. The
+ * handler runs on the shard's alarm thread, without its mutex held.
+ */
+typedef struct event_source_tag
+{
+    int fd;
+    void (*handler)(struct event_source_tag *source, uint32_t events);
+    void *arg;
+} event_source_t;
+
+#define ENGINE_COND 0  // alarm thread sleeps in pthread_cond_timedwait
+#define ENGINE_EPOLL 1 // alarm thread sleeps in epoll_wait on a timerfd
+#define SPIN_OFF 0      // block until the deadline
+#define SPIN_FIXED 1    // block until a fixed window before it, then spin
+#define SPIN_ADAPTIVE 2 // ... a window tuned from the wakeups' lateness
+#define SPIN_START 50000   // adaptive window to begin with (ns)
+#define SPIN_MIN 1000      // adaptive window bounds (ns)
+#define SPIN_MAX 500000
+#define EPOLL_EVENTS 64  // events taken from epoll_wait at once
+#define EXPIRE_BATCH 64  // alarms handed to the buffer at once
+
+/*
+ * A log-linear (HDR) histogram of nanosecond values. Values below
+ * 2^HISTOGRAM_SUB_BITS have buckets of their own; above that each
+ * power of two is split into 2^HISTOGRAM_SUB_BITS buckets, so any
+ * recorded value is known to within 1%.
+ */
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB)
+
+typedef struct histogram_tag
+{
+    long count[HISTOGRAM_BUCKETS];
+    long total;
+    alarm_time_t max;
+} histogram_t;
+
+/*
+ * Wait and hold times of a mutex, recorded while it is held, so
+ * the mutex itself protects them. Only kept with "-s", since each
+ * costs two clock reads per acquisition.
+ */
+typedef struct lock_stats_tag
+{
+    histogram_t wait;      // time to acquire
+    histogram_t hold;      // time held
+    alarm_time_t acquired; // when the holder acquired it
+} lock_stats_t;
+
+/*
+ * One shard of the alarm engine. Everything in it except thread
+ * is protected by its mutex.
+ */
+typedef struct alarm_shard_tag
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // waits on CLOCK_MONOTONIC
+    alarm_store_t store;
+    alarm_time_t current_alarm; // deadline the alarm thread waits for
+    alarm_time_t wait_target;   // when it asked to wake: current_alarm less the spin window
+    alarm_time_t spin_window;   // "adaptive" spin window
+    atomic_int spinning;        // alarm thread is spinning; alarm_wake() stops it
+    long spins;                 // spins to a deadline
+    alarm_time_t spin_time;     // ... and the time they took
+    histogram_t wakeup_late;    // blocking waits: wakeup - wait_target
+    int epoll_fd;               // "epoll" engine only
+    event_source_t timer;       // "epoll" engine timerfd
+    pthread_t thread;
+    lock_stats_t lock_stats;
+    long wakeups;               // alarm thread returns from cond waits
+    long timeouts;              // ... that reached the deadline
+    long spurious;              // ... with nothing changed and no timeout
+    long idle_wakeups;          // deadlines that found nothing due
+    long requeues;              // earlier deadlines from alarm_wake()
+    long fired;
+} alarm_shard_t;
+
+alarm_shard_t *alarm_shards;
+int alarm_shard_count;
+circular_buffer_t alarm_buffer;
+/*
+ * Catch-up policies for a periodic alarm whose display is at least
+ * one whole period late.
+ */
+#define CATCHUP_SKIP 0     // drop the missed periods without displaying
+#define CATCHUP_COALESCE 1 // display once, standing for all missed periods
+#define CATCHUP_BURST 2    // display every missed period, back to back
+
+/*
+ * Periodic alarms that have fired are split by a hash of alarm_id
+ * among the periodic display threads ("-p"), each with a display
+ * list of its own, ordered by next display time. The executor never
+ * takes a display list's mutex: it pushes alarms onto the list's
+ * lock-free inbox, and posts "wakeup" only if an alarm is due before
+ * the display thread's published deadline. The display thread moves
+ * the inbox into its list whenever it holds the mutex, so a slow
+ * display pass never stalls the executor, and an alarm in the inbox
+ * is as easy to cancel as one on the list.
+ */
+typedef struct alarm_display_tag
+{
+    pthread_mutex_t mutex;   // protects list, index and lock_stats
+    alarm_heap_t list;       // ordered by next display time
+    alarm_index_t index;     // alarm_id -> alarm on the list
+    lock_stats_t lock_stats;
+    _Alignas(CACHE_LINE) _Atomic(alarm_t *) inbox; // from the executor, linked by "link"
+    _Atomic(alarm_time_t) deadline;                // display thread's wakeup; 0 if idle
+    sem_t wakeup;
+    pthread_t thread;
+} alarm_display_t;
+
+alarm_display_t *alarm_displays;
+int alarm_display_count;
+
+/*
+ * The executor: a pool of worker threads ("-x", default 1) that run
+ * the actions of fired alarms, so the consumer only hands them out,
+ * and a slow action holds up nothing but the worker running it.
+ * Each worker has a deque of its own. The consumer appends each
+ * batch to one worker's deque, round robin; a worker takes from the
+ * front of its own deque, so alarms run in firing order, and an
+ * idle worker steals from the back of another's, taking the work
+ * its owner would reach last. "work" counts the alarms in all the
+ * deques, so a worker that takes a unit is sure to find one.
+ */
+typedef struct executor_worker_tag
+{
+    pthread_mutex_t mutex; // protects the deque
+    alarm_t **deque;       // ring of capacity slots (a power of two)
+    size_t first, count, capacity;
+    size_t max_depth;      // largest count so far
+    atomic_long executed;  // actions run by this worker
+    atomic_long steals;    // of those, taken from another worker
+    pthread_t thread;
+} executor_worker_t;
+
+executor_worker_t *executor_workers;
+int executor_count;
+sem_t executor_work;
+int display_catchup = CATCHUP_COALESCE;
+int alarm_engine = ENGINE_COND;
+int spin_mode = SPIN_OFF;
+alarm_time_t spin_fixed; // SPIN_FIXED window
+atomic_int spin_threads; // alarm threads now in shard_spin()
+int spin_cpus = 1;       // online CPUs; more spinners than this yield
+atomic_int next_alarm_id = 1;
+alarm_time_t alarm_slack; // "-w": slack of alarms without a hint
+
+histogram_t lateness_histogram; // fired_time - scheduled_time; lateness_mutex
+pthread_mutex_t lateness_mutex = PTHREAD_MUTEX_INITIALIZER;
+int stats_enabled;              // "-s": time lock waits and holds
+atomic_long server_connected;   // socket clients now connected
+atomic_long server_requests;    // commands read from socket clients
+atomic_long server_notified;    // firings sent to subscribers
+atomic_long server_dropped;     // firings lost to a full queue or a slow subscriber
+void *periodic_display_thread(void *arg);
+void *consumer_thread(void *arg);
+void server_notify(const alarm_t *alarm);
+static void alarm_print(alarm_t *alarm);
+void simulate(const char *path);
+
+/*
+ * Clocks. Everything that asks what time it is goes through
+ * alarm_now(), and so through alarm_clock: "monotonic", the real
+ * clock, or "virtual", whose time only moves when the replay driver
+ * (simulate()) moves it, straight to the next thing due. Only the
+ * real clock is ever waited on; under the virtual one no alarm,
+ * consumer, executor or display thread runs, and the driver does
+ * their work itself.
+ */
+typedef struct alarm_clock_tag
+{
+    const char *name;
+    alarm_time_t (*now)(void);
+} alarm_clock_t;
+
+static alarm_time_t monotonic_now(void)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+        errno_abort("Get monotonic time");
+    return (alarm_time_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+alarm_time_t virtual_time; // the "virtual" clock; set by simulate() only
+
+static alarm_time_t virtual_now(void)
+{
+    return virtual_time;
+}
+
+const alarm_clock_t alarm_clocks[] = {
+    {"monotonic", monotonic_now},
+    {"virtual", virtual_now},
+};
+const alarm_clock_t *alarm_clock = &alarm_clocks[0];
+
+alarm_time_t alarm_now(void)
+{
+    return alarm_clock->now();
+}
+
+/*
+ * The deadline of an alarm due at "when": "when" rounded up to a
+ * multiple of its slack. Alarms with the same slack that fall due
+ * within one slack of each other share a deadline, so one wakeup
+ * fires them all, and none fires more than its slack late.
+ */
+alarm_time_t alarm_deadline(alarm_time_t when, alarm_time_t slack)
+{
+    if (slack <= 0)
+        return when;
+    return (when + slack - 1) / slack * slack;
+}
+
+void alarm_timespec(alarm_time_t when, struct timespec *ts)
+{
+    ts->tv_sec = when / NSEC_PER_SEC;
+    ts->tv_nsec = when % NSEC_PER_SEC;
+}
+
+void histogram_record(histogram_t *histogram, alarm_time_t value)
+{
+    int exponent, index;
+
+    if (value < 0)
+        value = 0;
+    if (value < HISTOGRAM_SUB)
+        index = (int)value;
+    else
+    {
+        exponent = 63 - __builtin_clzll((uint64_t)value);
+        index = (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB
+                + (int)(value >> (exponent - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB;
+    }
+    histogram->count[index]++;
+    histogram->total++;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+/*
+ * The smallest value at or above the given fraction (0 to 1) of
+ * the recorded values, to the histogram's precision.
+ */
+alarm_time_t histogram_percentile(const histogram_t *histogram, double fraction)
+{
+    long seen = 0, wanted = (long)(fraction * histogram->total + 0.5);
+    alarm_time_t top;
+    int index;
+
+    if (wanted < 1)
+        wanted = 1;
+    for (index = 0; index < HISTOGRAM_BUCKETS; index++)
+    {
+        seen += histogram->count[index];
+        if (seen >= wanted)
+            break;
+    }
+    if (index >= HISTOGRAM_BUCKETS)
+        return histogram->max;
+    if (index < HISTOGRAM_SUB)
+        return index;
+    // The top of the bucket, but never beyond what was recorded.
+    top = ((alarm_time_t)(index % HISTOGRAM_SUB + HISTOGRAM_SUB + 1)
+           << (index / HISTOGRAM_SUB - 1)) - 1;
+    return top < histogram->max ? top : histogram->max;
+}
+
+/*
+ * Record the hold time of a mutex its caller is about to release,
+ * or to wait on a condition variable with.
+ */
+static void lock_stats_release(lock_stats_t *stats)
+{
+    if (stats_enabled)
+        histogram_record(&stats->hold, alarm_now() - stats->acquired);
+}
+
+/*
+ * Note that the caller now holds the mutex, having asked for it at
+ * "start" (0 if it was reacquired by a condition wait).
+ */
+static void lock_stats_acquire(lock_stats_t *stats, alarm_time_t start)
+{
+    if (stats_enabled)
+    {
+        stats->acquired = alarm_now();
+        if (start != 0)
+            histogram_record(&stats->wait, stats->acquired - start);
+    }
+}
+
+void shard_lock(alarm_shard_t *shard)
+{
+    alarm_time_t start = stats_enabled ? alarm_now() : 0;
+    int status;
+
+    status = pthread_mutex_lock(&shard->mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    lock_stats_acquire(&shard->lock_stats, start);
+}
+
+void shard_unlock(alarm_shard_t *shard)
+{
+    int status;
+
+    lock_stats_release(&shard->lock_stats);
+    status = pthread_mutex_unlock(&shard->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+}
+
+/*
+ * Parse a delay such as "2", "1.5s", "250ms", "40us" or "100ns"
+ * into nanoseconds. A bare number is in seconds. Returns 0 if
+ * "text" is not a delay.
+ */
+int parse_delay(const char *text, alarm_time_t *delay)
+{
+    alarm_time_t whole = 0, fraction = 0, scale = 1, unit;
+    const char *p = text;
+
+    if ((*p < '0' || *p > '9') && *p != '.')
+        return 0;
+    for (; *p >= '0' && *p <= '9'; p++)
+    {
+        if (whole > INT64_MAX / 10 / NSEC_PER_SEC)
+            return 0;
+        whole = whole * 10 + (*p - '0');
+    }
+    if (*p == '.')
+    {
+        for (p++; *p >= '0' && *p <= '9'; p++)
+        {
+            if (scale < NSEC_PER_SEC)
+            {
+                fraction = fraction * 10 + (*p - '0');
+                scale *= 10;
+            }
+        }
+    }
+    if (*p == '\0' || strcmp(p, "s") == 0)
+        unit = NSEC_PER_SEC;
+    else if (strcmp(p, "ms") == 0)
+        unit = 1000000;
+    else if (strcmp(p, "us") == 0)
+        unit = 1000;
+    else if (strcmp(p, "ns") == 0)
+        unit = 1;
+    else
+        return 0;
+    *delay = whole * unit + fraction * unit / scale;
+    return 1;
+}
+
+/*
+ * Parse an engine ("-e"): "cond" or "epoll", optionally followed by
+ * ":adaptive", ":off", or ":<window>" (a delay) for how it spins
+ * before each deadline. Returns 0 if "text" is not an engine.
+ */
+int parse_engine(const char *text)
+{
+    const char *colon = strchr(text, ':');
+    size_t length = colon ? (size_t)(colon - text) : strlen(text);
+
+    if (length == 4 && strncmp(text, "cond", 4) == 0)
+        alarm_engine = ENGINE_COND;
+    else if (length == 5 && strncmp(text, "epoll", 5) == 0)
+        alarm_engine = ENGINE_EPOLL;
+    else
+        return 0;
+    spin_mode = SPIN_OFF;
+    if (colon == NULL || strcmp(colon + 1, "off") == 0)
+        return 1;
+    if (strcmp(colon + 1, "adaptive") == 0)
+        spin_mode = SPIN_ADAPTIVE;
+    else if (parse_delay(colon + 1, &spin_fixed))
+        spin_mode = spin_fixed > 0 ? SPIN_FIXED : SPIN_OFF;
+    else
+        return 0;
+    return 1;
+}
+
+/*
+ * A parsed command line. The message points into the line and is
+ * not NUL-terminated.
+ */
+#define REQUEST_NONE 0   // blank line
+#define REQUEST_BAD 1
+#define REQUEST_ALARM 2  // "<delay> <message>" or "Periodic ..."
+#define REQUEST_CHANGE 3
+#define REQUEST_CANCEL 4
+#define REQUEST_POOL 5
+#define REQUEST_STATS 6
+#define REQUEST_SUBSCRIBE 7 // socket clients only
+#define REQUEST_RANGE 8  // "Cancel range", "Shift range" or "List range"
+#define RANGE_LIST 0
+#define RANGE_CANCEL 1
+#define RANGE_SHIFT 2
+#define RANGE_OPEN INT64_MIN // a range bound of "*"
+#define MESSAGE_MAX 1024 // longest message kept
+
+typedef struct alarm_request_tag
+{
+    int type;
+    int periodic;
+    int alarm_id;
+    alarm_time_t delay;
+    alarm_time_t slack;     // from "<delay>~<slack>"; -1 if not given
+    const char *message;    // REQUEST_RANGE: the message prefix, if any
+    size_t message_length;
+    int range;              // REQUEST_RANGE: RANGE_LIST, RANGE_CANCEL or RANGE_SHIFT
+    alarm_time_t from, to;  // REQUEST_RANGE window, as delays from now; or RANGE_OPEN
+} alarm_request_t;
+
+static const char *skip_blanks(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+/*
+ * Parse a word at *p, of at most 31 characters, as a delay with an
+ * optional slack hint ("250ms~10ms"). *slack is -1 without one.
+ */
+static int parse_delay_word(const char **p, const char *end,
+                            alarm_time_t *delay, alarm_time_t *slack)
+{
+    char word[32], *tilde;
+    size_t length = 0;
+    const char *q = skip_blanks(*p, end);
+
+    while (q < end && *q != ' ' && *q != '\t')
+    {
+        if (length == sizeof(word) - 1)
+            return 0;
+        word[length++] = *q++;
+    }
+    word[length] = '\0';
+    *p = q;
+    *slack = -1;
+    tilde = strchr(word, '~');
+    if (tilde != NULL)
+    {
+        *tilde = '\0';
+        if (!parse_delay(tilde + 1, slack))
+            return 0;
+    }
+    return parse_delay(word, delay);
+}
+
+static int parse_id(const char **p, const char *end, int *alarm_id)
+{
+    const char *q = skip_blanks(*p, end);
+    long id = 0;
+
+    if (q == end || *q < '0' || *q > '9')
+        return 0;
+    for (; q < end && *q >= '0' && *q <= '9'; q++)
+    {
+        id = id * 10 + (*q - '0');
+        if (id > INT32_MAX)
+            return 0;
+    }
+    *alarm_id = (int)id;
+    *p = q;
+    return 1;
+}
+
+static int keyword(const char **p, const char *end, const char *word, size_t length)
+{
+    if ((size_t)(end - *p) < length || memcmp(*p, word, length) != 0)
+        return 0;
+    if (*p + length < end && (*p)[length] != ' ' && (*p)[length] != '\t')
+        return 0;
+    *p += length;
+    return 1;
+}
+
+/*
+ * Parse a word at *p as a range bound: a delay, or "*" (RANGE_OPEN).
+ * With "sign", a delay may be negative (a shift earlier) and "*" is
+ * not allowed.
+ */
+static int parse_bound(const char **p, const char *end, alarm_time_t *bound, int sign)
+{
+    char word[32];
+    size_t length = 0;
+    const char *q = skip_blanks(*p, end);
+    int negative = sign && q < end && *q == '-';
+
+    q += negative;
+    while (q < end && *q != ' ' && *q != '\t')
+    {
+        if (length == sizeof(word) - 1)
+            return 0;
+        word[length++] = *q++;
+    }
+    word[length] = '\0';
+    *p = q;
+    if (!sign && strcmp(word, "*") == 0)
+    {
+        *bound = RANGE_OPEN;
+        return 1;
+    }
+    if (!parse_delay(word, bound))
+        return 0;
+    if (negative)
+        *bound = -*bound;
+    return 1;
+}
+
+/*
+ * Parse the rest of a range command after its keyword: "range",
+ * the window, a shift for Shift, and an optional message prefix.
+ */
+static int parse_range(const char **p, const char *end, alarm_request_t *request)
+{
+    *p = skip_blanks(*p, end);
+    if (!keyword(p, end, "range", 5)
+        || !parse_bound(p, end, &request->from, 0)
+        || !parse_bound(p, end, &request->to, 0)
+        || (request->range == RANGE_SHIFT && !parse_bound(p, end, &request->delay, 1)))
+        return 0;
+    *p = skip_blanks(*p, end);
+    request->message = *p;
+    request->message_length = end - *p < MESSAGE_MAX ? end - *p : MESSAGE_MAX;
+    request->type = REQUEST_RANGE;
+    return 1;
+}
+
+/*
+ * Parse one command from the line [line, end), without its newline.
+ * This replaces sscanf, which is slow enough to dominate bulk
+ * ingestion.
+ */
+int parse_request(const char *line, const char *end, alarm_request_t *request)
+{
+    const char *p;
+
+    while (end > line && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    p = skip_blanks(line, end);
+    request->type = REQUEST_BAD;
+    request->periodic = 0;
+    if (p == end)
+        request->type = REQUEST_NONE;
+    else if (keyword(&p, end, "Pool", 4))
+    {
+        if (p == end)
+            request->type = REQUEST_POOL;
+    }
+    else if (keyword(&p, end, "Stats", 5))
+    {
+        if (p == end)
+            request->type = REQUEST_STATS;
+    }
+    else if (keyword(&p, end, "Subscribe", 9))
+    {
+        if (p == end)
+            request->type = REQUEST_SUBSCRIBE;
+    }
+    else if (keyword(&p, end, "Cancel", 6))
+    {
+        request->range = RANGE_CANCEL;
+        if (parse_id(&p, end, &request->alarm_id) && skip_blanks(p, end) == end)
+            request->type = REQUEST_CANCEL;
+        else
+            parse_range(&p, end, request);
+    }
+    else if (keyword(&p, end, "Shift", 5))
+    {
+        request->range = RANGE_SHIFT;
+        parse_range(&p, end, request);
+    }
+    else if (keyword(&p, end, "List", 4))
+    {
+        request->range = RANGE_LIST;
+        parse_range(&p, end, request);
+    }
+    else if (keyword(&p, end, "Change", 6))
+    {
+        if (parse_id(&p, end, &request->alarm_id)
+            && parse_delay_word(&p, end, &request->delay, &request->slack))
+            request->type = REQUEST_CHANGE;
+    }
+    else
+    {
+        request->periodic = keyword(&p, end, "Periodic", 8);
+        if (parse_delay_word(&p, end, &request->delay, &request->slack)
+            && (!request->periodic || request->delay > 0))
+            request->type = REQUEST_ALARM;
+    }
+    if (request->type == REQUEST_CHANGE || request->type == REQUEST_ALARM)
+    {
+        p = skip_blanks(p, end);
+        if (p == end)
+            request->type = REQUEST_BAD;
+        request->message = p;
+        request->message_length = end - p < MESSAGE_MAX ? end - p : MESSAGE_MAX;
+    }
+    return request->type;
+}
+
+/*
+ * "list" backend: the original singly linked list, kept sorted by
+ * scheduled_time. Insert and remove walk the list.
+ */
+static void list_init(alarm_store_t *store)
+{
+    store->list = NULL;
+}
+
+static void list_insert(alarm_store_t *store, alarm_t *alarm)
+{
+    alarm_t **last, *next;
+
+    last = &store->list;
+    next = *last;
+    while (next != NULL)
+    {
+        if (next->scheduled_time >= alarm->scheduled_time)
+        {
+            alarm->link = next;
+            *last = alarm;
+            break;
+        }
+        last = &next->link;
+        next = next->link;
+    }
+    /*
+     * If we reached the end of the list, insert the new alarm
+     * there.  ("next" is NULL, and "last" points to the link
+     * field of the last item, or to the list header.)
+     */
+    if (next == NULL)
+    {
+        *last = alarm;
+        alarm->link = NULL;
+    }
+}
+
+static void list_remove(alarm_store_t *store, alarm_t *alarm)
+{
+    alarm_t **last;
+
+    for (last = &store->list; *last != NULL; last = &(*last)->link)
+    {
+        if (*last == alarm)
+        {
+            *last = alarm->link;
+            break;
+        }
+    }
+}
+
+static void list_reschedule(alarm_store_t *store, alarm_t *alarm, alarm_time_t when)
+{
+    list_remove(store, alarm);
+    alarm->scheduled_time = when;
+    list_insert(store, alarm);
+}
+
+static alarm_t *list_expire(alarm_store_t *store, alarm_time_t now)
+{
+    alarm_t *alarm = store->list;
+
+    if (alarm == NULL || alarm->scheduled_time > now)
+        return NULL;
+    store->list = alarm->link;
+    return alarm;
+}
+
+static alarm_time_t list_next_deadline(alarm_store_t *store)
+{
+    return store->list->scheduled_time;
+}
+
+/*
+ * "wheel" backend: a hierarchical timing wheel. An alarm goes on
+ * the lowest level whose range covers its distance from the
+ * wheel's current tick, in the slot its scheduled_time indexes.
+ * When the wheel reaches the start of a higher level slot, that
+ * slot is "cascaded": its alarms are placed again, and land on a
+ * lower level. Level 0 slots are moved to the expired list as the
+ * wheel passes them.
+ */
+static void wheel_push(alarm_t **head, alarm_t *alarm)
+{
+    alarm->prev = NULL;
+    alarm->link = *head;
+    if (*head != NULL)
+        (*head)->prev = alarm;
+    *head = alarm;
+}
+
+static void wheel_place(timing_wheel_t *wheel, alarm_t *alarm)
+{
+    int64_t expires, delta;
+    int level, index;
+
+    expires = (alarm->scheduled_time + ((int64_t)1 << WHEEL_TICK_SHIFT) - 1)
+              >> WHEEL_TICK_SHIFT;
+    delta = expires - wheel->current;
+    if (delta < 0)
+    {
+        alarm->slot = WHEEL_EXPIRED;
+        alarm->link = NULL;
+        alarm->prev = wheel->expired_tail;
+        if (wheel->expired_tail != NULL)
+            wheel->expired_tail->link = alarm;
+        else
+            wheel->expired = alarm;
+        wheel->expired_tail = alarm;
+        return;
+    }
+    for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+        if (delta < (int64_t)1 << (WHEEL_BITS * (level + 1)))
+        {
+            index = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            wheel_push(&wheel->slot[level][index], alarm);
+            wheel->occupied[level] |= (uint64_t)1 << index;
+            alarm->slot = level * WHEEL_SIZE + index;
+            return;
+        }
+    }
+    wheel_push(&wheel->overflow, alarm);
+    alarm->slot = WHEEL_OVERFLOW;
+}
+
+/*
+ * Detach every alarm in a slot list and place it again relative to
+ * the wheel's current tick.
+ */
+static void wheel_cascade(timing_wheel_t *wheel, alarm_t **head)
+{
+    alarm_t *alarm, *next;
+
+    alarm = *head;
+    *head = NULL;
+    while (alarm != NULL)
+    {
+        next = alarm->link;
+        wheel_place(wheel, alarm);
+        alarm = next;
+    }
+}
+
+/*
+ * Find the first tick, at or after the current one, on which the
+ * wheel has work to do: a non-empty level 0 slot to expire, or a
+ * non-empty higher slot (or the overflow list) to cascade.
+ */
+static int64_t wheel_next_event(timing_wheel_t *wheel)
+{
+    int64_t when, next = -1;
+    uint64_t bits;
+    int level, shift, pos, k;
+
+    for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+        bits = wheel->occupied[level];
+        if (bits == 0)
+            continue;
+        shift = WHEEL_BITS * level;
+        pos = (wheel->current >> shift) & WHEEL_MASK;
+        if (pos != 0)
+            bits = (bits >> pos) | (bits << (WHEEL_SIZE - pos));
+        /*
+         * Between two of its boundaries, a level's own slot only
+         * holds alarms for its next trip round the wheel.
+         */
+        if (level > 0 && (wheel->current & (((int64_t)1 << shift) - 1)) != 0)
+            bits &= ~(uint64_t)1;
+        k = bits != 0 ? __builtin_ctzll(bits) : WHEEL_SIZE;
+        when = ((wheel->current >> shift) + k) << shift;
+        if (next < 0 || when < next)
+            next = when;
+    }
+    if (wheel->overflow != NULL)
+    {
+        shift = WHEEL_BITS * WHEEL_LEVELS;
+        if ((wheel->current & (((int64_t)1 << shift) - 1)) == 0)
+            when = wheel->current;
+        else
+            when = ((wheel->current >> shift) + 1) << shift;
+        if (next < 0 || when < next)
+            next = when;
+    }
+    return next;
+}
+
+/*
+ * Run the wheel forward to "now", jumping straight from one tick
+ * with work to the next.
+ */
+static void wheel_advance(timing_wheel_t *wheel, int64_t now)
+{
+    int64_t tick;
+    alarm_t *alarm, *next;
+    int level, index, shift;
+
+    while ((tick = wheel_next_event(wheel)) >= 0 && tick <= now)
+    {
+        wheel->current = tick;
+        shift = WHEEL_BITS * WHEEL_LEVELS;
+        if ((tick & (((int64_t)1 << shift) - 1)) == 0)
+            wheel_cascade(wheel, &wheel->overflow);
+        for (level = WHEEL_LEVELS - 1; level > 0; level--)
+        {
+            shift = WHEEL_BITS * level;
+            if ((tick & (((int64_t)1 << shift) - 1)) != 0)
+                continue;
+            index = (tick >> shift) & WHEEL_MASK;
+            wheel->occupied[level] &= ~((uint64_t)1 << index);
+            wheel_cascade(wheel, &wheel->slot[level][index]);
+        }
+        /*
+         * Level 0 alarms in this tick's slot are due. Setting the
+         * current tick past them makes wheel_place() put them on
+         * the expired list.
+         */
+        index = tick & WHEEL_MASK;
+        wheel->occupied[0] &= ~((uint64_t)1 << index);
+        alarm = wheel->slot[0][index];
+        wheel->slot[0][index] = NULL;
+        wheel->current = tick + 1;
+        while (alarm != NULL)
+        {
+            next = alarm->link;
+            wheel_place(wheel, alarm);
+            alarm = next;
+        }
+    }
+    if (wheel->current <= now)
+        wheel->current = now + 1;
+}
+
+static void wheel_init(alarm_store_t *store)
+{
+    memset(&store->wheel, 0, sizeof(store->wheel));
+    store->wheel.current = alarm_now() >> WHEEL_TICK_SHIFT;
+}
+
+static void wheel_insert(alarm_store_t *store, alarm_t *alarm)
+{
+    wheel_place(&store->wheel, alarm);
+}
+
+static void wheel_remove(alarm_store_t *store, alarm_t *alarm)
+{
+    timing_wheel_t *wheel = &store->wheel;
+    alarm_t **head;
+    int level, index;
+
+    level = alarm->slot / WHEEL_SIZE;
+    index = alarm->slot % WHEEL_SIZE;
+    if (alarm->slot == WHEEL_EXPIRED)
+    {
+        head = &wheel->expired;
+        if (wheel->expired_tail == alarm)
+            wheel->expired_tail = alarm->prev;
+    }
+    else if (alarm->slot == WHEEL_OVERFLOW)
+        head = &wheel->overflow;
+    else
+        head = &wheel->slot[level][index];
+
+    if (alarm->prev != NULL)
+        alarm->prev->link = alarm->link;
+    else
+        *head = alarm->link;
+    if (alarm->link != NULL)
+        alarm->link->prev = alarm->prev;
+    if (alarm->slot >= 0 && *head == NULL)
+        wheel->occupied[level] &= ~((uint64_t)1 << index);
+}
+
+static void wheel_reschedule(alarm_store_t *store, alarm_t *alarm, alarm_time_t when)
+{
+    wheel_remove(store, alarm);
+    alarm->scheduled_time = when;
+    wheel_place(&store->wheel, alarm);
+}
+
+static alarm_t *wheel_expire(alarm_store_t *store, alarm_time_t now)
+{
+    timing_wheel_t *wheel = &store->wheel;
+    alarm_t *alarm;
+
+    if (wheel->expired == NULL)
+        wheel_advance(wheel, now >> WHEEL_TICK_SHIFT);
+    alarm = wheel->expired;
+    if (alarm != NULL)
+        wheel_remove(store, alarm);
+    return alarm;
+}
+
+static alarm_time_t wheel_next_deadline(alarm_store_t *store)
+{
+    if (store->wheel.expired != NULL)
+        return (store->wheel.current - 1) << WHEEL_TICK_SHIFT;
+    return wheel_next_event(&store->wheel) << WHEEL_TICK_SHIFT;
+}
+
+/*
+ * "heap" backend: a HEAP_ARITY-ary min-heap on scheduled_time.
+ * Each alarm's slot field holds its index in node[], so an alarm
+ * found through the id index can be removed or rescheduled in
+ * O(log n) without searching the heap.
+ */
+static void heap_set(alarm_heap_t *heap, size_t index, alarm_t *alarm, alarm_time_t key)
+{
+    heap->node[index] = alarm;
+    heap->key[index] = key;
+    alarm->slot = (int)index;
+}
+
+/*
+ * The child of the node whose children start at "first" with the
+ * earliest deadline. The four keys are always there (those past
+ * the end are INT64_MAX), so this is a fixed, branch-free reduction
+ * over one aligned group that a compiler can keep in registers.
+ */
+static inline size_t heap_min_child(const alarm_time_t *key, size_t first)
+{
+    size_t low = first + (key[first + 1] < key[first]);
+    size_t high = first + 2 + (key[first + 3] < key[first + 2]);
+
+    return key[high] < key[low] ? high : low;
+}
+
+static void heap_sift_up(alarm_heap_t *heap, size_t index)
+{
+    alarm_t *alarm = heap->node[index];
+    alarm_time_t key = heap->key[index];
+    size_t parent;
+
+    while (index > 0)
+    {
+        parent = (index - 1) / HEAP_ARITY;
+        if (heap->key[parent] <= key)
+            break;
+        heap_set(heap, index, heap->node[parent], heap->key[parent]);
+        index = parent;
+    }
+    heap_set(heap, index, alarm, key);
+}
+
+static void heap_sift_down(alarm_heap_t *heap, size_t index)
+{
+    alarm_t *alarm = heap->node[index];
+    alarm_time_t key = heap->key[index];
+    size_t first, best;
+
+    while (1)
+    {
+        first = index * HEAP_ARITY + 1;
+        if (first >= heap->size)
+            break;
+        best = heap_min_child(heap->key, first);
+        if (heap->key[best] >= key)
+            break;
+        heap_set(heap, index, heap->node[best], heap->key[best]);
+        index = best;
+    }
+    heap_set(heap, index, alarm, key);
+}
+
+/*
+ * Restore heap order around an alarm whose scheduled_time changed.
+ */
+static void heap_fix(alarm_heap_t *heap, size_t index)
+{
+    heap->key[index] = heap->node[index]->scheduled_time;
+    if (index > 0 && heap->key[index] < heap->key[(index - 1) / HEAP_ARITY])
+        heap_sift_up(heap, index);
+    else
+        heap_sift_down(heap, index);
+}
+
+/*
+ * Grow the heap to "capacity" alarms. key[] is allocated with
+ * HEAP_KEY_PAD keys in front, so that children's groups, which
+ * start at 4i + 1, fall on 32-byte boundaries, and HEAP_ARITY
+ * spare keys behind, so the last group is never short.
+ */
+static void heap_grow(alarm_heap_t *heap, size_t capacity)
+{
+    alarm_t **node;
+    alarm_time_t *key;
+    size_t i;
+
+    node = (alarm_t **)realloc(heap->node, capacity * sizeof(alarm_t *));
+    key = (alarm_time_t *)aligned_alloc(CACHE_LINE,
+        (capacity + HEAP_KEY_PAD + HEAP_ARITY) * sizeof(alarm_time_t));
+    if (node == NULL || key == NULL)
+        errno_abort("Allocate heap");
+    key += HEAP_KEY_PAD;
+    if (heap->key != NULL)
+    {
+        memcpy(key, heap->key, heap->size * sizeof(alarm_time_t));
+        free(heap->key - HEAP_KEY_PAD);
+    }
+    for (i = heap->size; i < capacity + HEAP_ARITY; i++)
+        key[i] = INT64_MAX;
+    heap->node = node;
+    heap->key = key;
+    heap->capacity = capacity;
+}
+
+static void heap_push(alarm_heap_t *heap, alarm_t *alarm)
+{
+    if (heap->size == heap->capacity)
+        heap_grow(heap, heap->capacity ? heap->capacity * 2 : 64);
+    heap_set(heap, heap->size++, alarm, alarm->scheduled_time);
+    heap_sift_up(heap, heap->size - 1);
+}
+
+static void heap_delete(alarm_heap_t *heap, alarm_t *alarm)
+{
+    size_t index = (size_t)alarm->slot;
+
+    heap->size--;
+    if (index != heap->size)
+    {
+        heap_set(heap, index, heap->node[heap->size], heap->key[heap->size]);
+        heap->key[heap->size] = INT64_MAX;
+        heap_fix(heap, index);
+    }
+    else
+        heap->key[heap->size] = INT64_MAX;
+}
+
+static void heap_init(alarm_store_t *store)
+{
+    store->heap.node = NULL;
+    store->heap.key = NULL;
+    store->heap.size = 0;
+    store->heap.capacity = 0;
+}
+
+static void heap_insert(alarm_store_t *store, alarm_t *alarm)
+{
+    heap_push(&store->heap, alarm);
+}
+
+static void heap_remove(alarm_store_t *store, alarm_t *alarm)
+{
+    heap_delete(&store->heap, alarm);
+}
+
+static void heap_reschedule(alarm_store_t *store, alarm_t *alarm, alarm_time_t when)
+{
+    alarm->scheduled_time = when;
+    heap_fix(&store->heap, (size_t)alarm->slot);
+}
+
+static alarm_t *heap_expire(alarm_store_t *store, alarm_time_t now)
+{
+    alarm_t *alarm;
+
+    if (store->heap.size == 0)
+        return NULL;
+    if (store->heap.key[0] > now)
+        return NULL;
+    alarm = store->heap.node[0];
+    heap_remove(store, alarm);
+    return alarm;
+}
+
+static alarm_time_t heap_next_deadline(alarm_store_t *store)
+{
+    return store->heap.key[0];
+}
+
+const alarm_backend_t alarm_backends[] = {
+    {"wheel", wheel_init, wheel_insert, wheel_remove, wheel_reschedule,
+     wheel_expire, wheel_next_deadline},
+    {"list", list_init, list_insert, list_remove, list_reschedule,
+     list_expire, list_next_deadline},
+    {"heap", heap_init, heap_insert, heap_remove, heap_reschedule,
+     heap_expire, heap_next_deadline},
+};
+#define ALARM_BACKENDS (sizeof(alarm_backends) / sizeof(alarm_backends[0]))
+
+/*
+ * The id index. Deleting shifts later entries of the probe
+ * sequence back into the hole, so lookups never need tombstones.
+ */
+static size_t index_hash(int alarm_id)
+{
+    return (size_t)((uint32_t)alarm_id * 2654435761u);
+}
+
+static void index_init(alarm_index_t *index, size_t buckets)
+{
+    index->bucket = (index_bucket_t *)calloc(buckets, sizeof(index_bucket_t));
+    if (index->bucket == NULL)
+        errno_abort("Allocate alarm index");
+    index->mask = buckets - 1;
+    index->count = 0;
+}
+
+static void index_put(alarm_index_t *index, alarm_t *alarm)
+{
+    index_bucket_t *old;
+    size_t i, buckets;
+
+    if ((index->count + 1) * 2 > index->mask + 1)
+    {
+        old = index->bucket;
+        buckets = index->mask + 1;
+        index_init(index, buckets * 2);
+        for (i = 0; i < buckets; i++)
+            if (old[i].alarm_id != 0)
+                index_put(index, old[i].alarm);
+        free(old);
+    }
+    i = index_hash(alarm->alarm_id) & index->mask;
+    while (index->bucket[i].alarm_id != 0)
+        i = (i + 1) & index->mask;
+    index->bucket[i].alarm_id = alarm->alarm_id;
+    index->bucket[i].alarm = alarm;
+    index->count++;
+}
+
+static alarm_t *index_get(alarm_index_t *index, int alarm_id)
+{
+    size_t i;
+
+    i = index_hash(alarm_id) & index->mask;
+    while (index->bucket[i].alarm_id != 0)
+    {
+        if (index->bucket[i].alarm_id == alarm_id)
+            return index->bucket[i].alarm;
+        i = (i + 1) & index->mask;
+    }
+    return NULL;
+}
+
+static void index_delete(alarm_index_t *index, int alarm_id)
+{
+    size_t hole, i, home;
+
+    hole = index_hash(alarm_id) & index->mask;
+    while (index->bucket[hole].alarm_id != 0 && index->bucket[hole].alarm_id != alarm_id)
+        hole = (hole + 1) & index->mask;
+    if (index->bucket[hole].alarm_id == 0)
+        return;
+    index->count--;
+    for (i = (hole + 1) & index->mask; index->bucket[i].alarm_id != 0; i = (i + 1) & index->mask)
+    {
+        /*
+         * An entry may fill the hole only if its home bucket is not
+         * cyclically between the hole and where it now sits.
+         */
+        home = index_hash(index->bucket[i].alarm_id) & index->mask;
+        if (((i - home) & index->mask) >= ((i - hole) & index->mask))
+        {
+            index->bucket[hole] = index->bucket[i];
+            hole = i;
+        }
+    }
+    index->bucket[hole].alarm_id = 0;
+    index->bucket[hole].alarm = NULL;
+}
+
+/*
+ * Time-range index. Whatever the backend, a store also keeps its
+ * alarms in a B+tree ordered by (scheduled_time, alarm_id), so the
+ * range commands find the k alarms due in a window in O(k log n)
+ * instead of asking for each one by id. A message prefix is not
+ * indexed: it is matched against each of the k. The keys are packed into
+ * the nodes, so a descent reads a few cache lines a level and never
+ * touches the alarms, and the upper levels stay cached. A node that
+ * empties is dropped, and one that fits with its neighbour in
+ * RANGE_MERGE entries is merged into it, which keeps the tree
+ * shallow without ever borrowing entries. Nodes are reused from the
+ * store's spare list, so steady churn does not allocate.
+ */
+static range_node_t *range_node(alarm_store_t *store, int leaf)
+{
+    range_node_t *node = store->range_spare;
+
+    if (node != NULL)
+        store->range_spare = node->next;
+    else
+    {
+        node = (range_node_t *)aligned_alloc(CACHE_LINE, sizeof(range_node_t));
+        if (node == NULL)
+            errno_abort("Allocate range index node");
+    }
+    node->count = 0;
+    node->leaf = leaf;
+    return node;
+}
+
+static void range_release(alarm_store_t *store, range_node_t *node)
+{
+    node->next = store->range_spare;
+    store->range_spare = node;
+}
+
+static inline int range_less(alarm_time_t time1, int id1, alarm_time_t time2, int id2)
+{
+    return time1 < time2 || (time1 == time2 && id1 < id2);
+}
+
+/*
+ * The number of a leaf's entries before (when, alarm_id).
+ */
+static int range_rank(const range_node_t *node, alarm_time_t when, int alarm_id)
+{
+    int low = 0, high = node->count, mid;
+
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+        if (range_less(node->time[mid], node->id[mid], when, alarm_id))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/*
+ * The child of an inner node whose subtree holds (when, alarm_id):
+ * the last one keyed at or before it.
+ */
+static int range_slot(const range_node_t *node, alarm_time_t when, int alarm_id)
+{
+    int low = 1, high = node->count, mid;
+
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+        if (range_less(when, alarm_id, node->time[mid], node->id[mid]))
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return low - 1;
+}
+
+/*
+ * Descend from the root to the leaf for (when, alarm_id), noting
+ * each inner node and the child taken in path[] and slots[]. Sets
+ * *depth to the number of inner nodes.
+ */
+static range_node_t *range_descend(alarm_store_t *store, alarm_time_t when, int alarm_id,
+                                   range_node_t **path, int *slots, int *depth)
+{
+    range_node_t *node = store->range;
+
+    for (*depth = 0; !node->leaf; (*depth)++)
+    {
+        path[*depth] = node;
+        slots[*depth] = range_slot(node, when, alarm_id);
+        node = (range_node_t *)node->item[slots[*depth]];
+    }
+    return node;
+}
+
+static void range_put(range_node_t *node, int i, alarm_time_t when, int alarm_id, void *item)
+{
+    int after = node->count - i;
+
+    memmove(&node->time[i + 1], &node->time[i], after * sizeof(node->time[0]));
+    memmove(&node->id[i + 1], &node->id[i], after * sizeof(node->id[0]));
+    memmove(&node->item[i + 1], &node->item[i], after * sizeof(node->item[0]));
+    node->time[i] = when;
+    node->id[i] = alarm_id;
+    node->item[i] = item;
+    node->count++;
+}
+
+static void range_cut(range_node_t *node, int i)
+{
+    int after = node->count - i - 1;
+
+    memmove(&node->time[i], &node->time[i + 1], after * sizeof(node->time[0]));
+    memmove(&node->id[i], &node->id[i + 1], after * sizeof(node->id[0]));
+    memmove(&node->item[i], &node->item[i + 1], after * sizeof(node->item[0]));
+    node->count--;
+}
+
+/*
+ * Append "count" of "from"'s entries, starting at "first", to "to".
+ */
+static void range_append(range_node_t *to, const range_node_t *from, int first, int count)
+{
+    memcpy(&to->time[to->count], &from->time[first], count * sizeof(to->time[0]));
+    memcpy(&to->id[to->count], &from->id[first], count * sizeof(to->id[0]));
+    memcpy(&to->item[to->count], &from->item[first], count * sizeof(to->item[0]));
+    to->count += count;
+}
+
+static void range_insert(alarm_store_t *store, alarm_t *alarm)
+{
+    range_node_t *path[RANGE_DEPTH], *node, *split, *root;
+    int slots[RANGE_DEPTH], depth, i;
+    alarm_time_t when = alarm->scheduled_time;
+    int alarm_id = alarm->alarm_id;
+    void *item = alarm;
+
+    if (store->range == NULL)
+        store->range = range_node(store, 1);
+    node = range_descend(store, when, alarm_id, path, slots, &depth);
+    i = range_rank(node, when, alarm_id);
+    // Split full nodes on the way back up.
+    while (node->count == RANGE_ORDER)
+    {
+        split = range_node(store, node->leaf);
+        range_append(split, node, RANGE_ORDER / 2, RANGE_ORDER / 2);
+        node->count = RANGE_ORDER / 2;
+        if (i <= RANGE_ORDER / 2)
+            range_put(node, i, when, alarm_id, item);
+        else
+            range_put(split, i - RANGE_ORDER / 2, when, alarm_id, item);
+        // The parent gains the new node, keyed by its first entry.
+        when = split->time[0];
+        alarm_id = split->id[0];
+        item = split;
+        if (depth == 0)
+        {
+            root = range_node(store, 0);
+            range_put(root, 0, node->time[0], node->id[0], node);
+            range_put(root, 1, when, alarm_id, split);
+            store->range = root;
+            return;
+        }
+        depth--;
+        node = path[depth];
+        i = slots[depth] + 1;
+    }
+    range_put(node, i, when, alarm_id, item);
+}
+
+static void range_remove(alarm_store_t *store, alarm_t *alarm)
+{
+    range_node_t *path[RANGE_DEPTH], *node, *parent, *left, *right;
+    int slots[RANGE_DEPTH], depth, slot;
+
+    node = range_descend(store, alarm->scheduled_time, alarm->alarm_id, path, slots, &depth);
+    range_cut(node, range_rank(node, alarm->scheduled_time, alarm->alarm_id));
+    // Drop empty nodes and merge small ones on the way back up.
+    while (depth > 0)
+    {
+        parent = path[--depth];
+        slot = slots[depth];
+        if (node->count == 0)
+        {
+            range_cut(parent, slot);
+            range_release(store, node);
+        }
+        else
+        {
+            if (parent->count == 1)
+                return;
+            if (slot == 0)
+                slot = 1;
+            left = (range_node_t *)parent->item[slot - 1];
+            right = (range_node_t *)parent->item[slot];
+            if (left->count + right->count > RANGE_MERGE)
+                return;
+            if (!right->leaf)
+            {
+                // Its first child's key was not kept; the parent's is.
+                right->time[0] = parent->time[slot];
+                right->id[0] = parent->id[slot];
+            }
+            range_append(left, right, 0, right->count);
+            range_cut(parent, slot);
+            range_release(store, right);
+        }
+        node = parent;
+    }
+    // A root down to one child gives way to it.
+    while (!node->leaf && node->count == 1)
+    {
+        store->range = (range_node_t *)node->item[0];
+        range_release(store, node);
+        node = store->range;
+    }
+}
+
+/*
+ * The first alarm after (when, alarm_id), or NULL.
+ */
+static alarm_t *range_next(alarm_store_t *store, alarm_time_t when, int alarm_id)
+{
+    range_node_t *path[RANGE_DEPTH], *node;
+    int slots[RANGE_DEPTH], depth, i;
+
+    if (store->range == NULL)
+        return NULL;
+    node = range_descend(store, when, alarm_id, path, slots, &depth);
+    i = range_rank(node, when, alarm_id);
+    if (i < node->count && node->time[i] == when && node->id[i] == alarm_id)
+        i++;
+    if (i < node->count)
+        return (alarm_t *)node->item[i];
+    // Up to the next subtree to the right, then down its left edge.
+    while (depth-- > 0)
+    {
+        if (slots[depth] + 1 < path[depth]->count)
+        {
+            node = (range_node_t *)path[depth]->item[slots[depth] + 1];
+            while (!node->leaf)
+                node = (range_node_t *)node->item[0];
+            return (alarm_t *)node->item[0];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The last alarm before (when, alarm_id), or NULL.
+ */
+static alarm_t *range_prev(alarm_store_t *store, alarm_time_t when, int alarm_id)
+{
+    range_node_t *path[RANGE_DEPTH], *node;
+    int slots[RANGE_DEPTH], depth, i;
+
+    if (store->range == NULL)
+        return NULL;
+    node = range_descend(store, when, alarm_id, path, slots, &depth);
+    i = range_rank(node, when, alarm_id);
+    if (i > 0)
+        return (alarm_t *)node->item[i - 1];
+    // Up to the next subtree to the left, then down its right edge.
+    while (depth-- > 0)
+    {
+        if (slots[depth] > 0)
+        {
+            node = (range_node_t *)path[depth]->item[slots[depth] - 1];
+            while (!node->leaf)
+                node = (range_node_t *)node->item[node->count - 1];
+            return (alarm_t *)node->item[node->count - 1];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The last alarm due at or before "when", or NULL. Only an alarm
+ * keyed (when, INT32_MAX) itself escapes range_prev(when, INT32_MAX).
+ */
+static alarm_t *range_last(alarm_store_t *store, alarm_time_t when)
+{
+    range_node_t *path[RANGE_DEPTH], *node;
+    int slots[RANGE_DEPTH], depth, i;
+
+    if (store->range == NULL)
+        return NULL;
+    node = range_descend(store, when, INT32_MAX, path, slots, &depth);
+    i = range_rank(node, when, INT32_MAX);
+    if (i < node->count && node->time[i] == when && node->id[i] == INT32_MAX)
+        return (alarm_t *)node->item[i];
+    return range_prev(store, when, INT32_MAX);
+}
+
+/*
+ * Store wrappers: run the backend operation, and keep the id index,
+ * the time-range index and the pending count in step with it.
+ */
+static void store_add(alarm_store_t *store, alarm_t *alarm)
+{
+    store->backend->insert(store, alarm);
+    index_put(&store->index, alarm);
+    range_insert(store, alarm);
+    store->count++;
+}
+
+static void store_remove(alarm_store_t *store, alarm_t *alarm)
+{
+    store->backend->remove(store, alarm);
+    index_delete(&store->index, alarm->alarm_id);
+    range_remove(store, alarm);
+    store->count--;
+}
+
+static void store_reschedule(alarm_store_t *store, alarm_t *alarm, alarm_time_t when)
+{
+    range_remove(store, alarm);
+    store->backend->reschedule(store, alarm, when);
+    range_insert(store, alarm);
+}
+
+static alarm_t *store_find(alarm_store_t *store, int alarm_id)
+{
+    return index_get(&store->index, alarm_id);
+}
+
+static alarm_t *store_expire(alarm_store_t *store, alarm_time_t now)
+{
+    alarm_t *alarm;
+
+    alarm = store->backend->expire(store, now);
+    if (alarm != NULL)
+    {
+        index_delete(&store->index, alarm->alarm_id);
+        range_remove(store, alarm);
+        store->count--;
+    }
+    return alarm;
+}
+
+/*
+ * Output stage. A thread formats output into chunks of its own with
+ * output_printf(), without locking, and output_flush() queues them
+ * for the writer thread, which writes whole batches of chunks to
+ * stdout with writev(). output_mutex is only held to move chunks on
+ * and off the queue, never across the write. At most OUTPUT_QUEUE
+ * chunks wait for the writer; with OUTPUT_BLOCK a thread flushing
+ * into a full queue waits for room, with OUTPUT_DROP the chunk is
+ * thrown away and counted in output_dropped.
+ */
+#define OUTPUT_CHUNK 4096 // bytes per chunk, including a NUL
+#define OUTPUT_QUEUE 256  // chunks waiting for the writer
+#define OUTPUT_IOV 64     // chunks per writev()
+#define OUTPUT_BLOCK 0
+#define OUTPUT_DROP 1
+
+typedef struct output_chunk_tag
+{
+    struct output_chunk_tag *next;
+    size_t length;
+    char data[OUTPUT_CHUNK];
+} output_chunk_t;
+
+pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t output_ready = PTHREAD_COND_INITIALIZER; // queue not empty
+pthread_cond_t output_space = PTHREAD_COND_INITIALIZER; // queue has room, or writer idle
+output_chunk_t *output_head, *output_tail; // queued for the writer
+output_chunk_t *output_free;               // spare chunks
+int output_queued;                         // chunks on the queue
+int output_writing;                        // writer is in writev()
+int output_policy = OUTPUT_BLOCK;
+long output_dropped;                       // chunks lost to OUTPUT_DROP
+long output_writes;                        // writev() calls; output_mutex
+static __thread output_chunk_t *output_first, *output_last; // not yet flushed
+
+static output_chunk_t *output_chunk(void)
+{
+    output_chunk_t *chunk;
+    int status;
+
+    status = pthread_mutex_lock(&output_mutex);
+    if (status != 0)
+        err_abort(status, "Lock output mutex");
+    chunk = output_free;
+    if (chunk != NULL)
+        output_free = chunk->next;
+    status = pthread_mutex_unlock(&output_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock output mutex");
+    if (chunk == NULL)
+    {
+        chunk = (output_chunk_t *)malloc(sizeof(output_chunk_t));
+        if (chunk == NULL)
+            errno_abort("Allocate output chunk");
+    }
+    chunk->next = NULL;
+    chunk->length = 0;
+    if (output_last != NULL)
+        output_last->next = chunk;
+    else
+        output_first = chunk;
+    output_last = chunk;
+    return chunk;
+}
+
+void output_printf(const char *format, ...)
+{
+    output_chunk_t *chunk = output_last;
+    va_list args;
+    int length = OUTPUT_CHUNK;
+
+    if (chunk != NULL)
+    {
+        va_start(args, format);
+        length = vsnprintf(chunk->data + chunk->length,
+                           OUTPUT_CHUNK - chunk->length, format, args);
+        va_end(args);
+    }
+    if (length < 0)
+        return;
+    if ((size_t)length >= OUTPUT_CHUNK - (chunk ? chunk->length : 0))
+    {
+        chunk = output_chunk();
+        va_start(args, format);
+        length = vsnprintf(chunk->data, OUTPUT_CHUNK, format, args);
+        va_end(args);
+        if (length < 0)
+            return;
+        if (length >= OUTPUT_CHUNK)
+            length = OUTPUT_CHUNK - 1; // truncated
+    }
+    chunk->length += length;
+}
+
+/*
+ * Queue everything this thread has formatted. The caller must not
+ * hold any scheduler lock: with OUTPUT_BLOCK this may wait.
+ */
+void output_flush(void)
+{
+    output_chunk_t *chunk, *next;
+    int status;
+
+    if (output_first == NULL)
+        return;
+    status = pthread_mutex_lock(&output_mutex);
+    if (status != 0)
+        err_abort(status, "Lock output mutex");
+    for (chunk = output_first; chunk != NULL; chunk = next)
+    {
+        next = chunk->next;
+        chunk->next = NULL;
+        while (output_queued >= OUTPUT_QUEUE && output_policy == OUTPUT_BLOCK)
+        {
+            // The writer may be asleep on what we queued so far.
+            status = pthread_cond_signal(&output_ready);
+            if (status != 0)
+                err_abort(status, "Signal output ready");
+            status = pthread_cond_wait(&output_space, &output_mutex);
+            if (status != 0)
+                err_abort(status, "Wait on output space");
+        }
+        if (output_queued >= OUTPUT_QUEUE)
+        {
+            chunk->next = output_free;
+            output_free = chunk;
+            output_dropped++;
+            continue;
+        }
+        if (output_tail != NULL)
+            output_tail->next = chunk;
+        else
+            output_head = chunk;
+        output_tail = chunk;
+        output_queued++;
+    }
+    status = pthread_cond_signal(&output_ready);
+    if (status != 0)
+        err_abort(status, "Signal output ready");
+    status = pthread_mutex_unlock(&output_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock output mutex");
+    output_first = output_last = NULL;
+}
+
+/*
+ * Flush, then wait until the writer has written everything queued.
+ */
+void output_drain(void)
+{
+    int status;
+
+    output_flush();
+    status = pthread_mutex_lock(&output_mutex);
+    if (status != 0)
+        err_abort(status, "Lock output mutex");
+    while (output_queued > 0 || output_writing)
+    {
+        status = pthread_cond_wait(&output_space, &output_mutex);
+        if (status != 0)
+            err_abort(status, "Wait on output space");
+    }
+    status = pthread_mutex_unlock(&output_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock output mutex");
+}
+
+/*
+ * The writer thread's start routine.
+ */
+void *output_thread(void *arg)
+{
+    output_chunk_t *batch, *chunk, *last;
+    struct iovec iov[OUTPUT_IOV];
+    int status, count, first, writes;
+    ssize_t written;
+
+    status = pthread_mutex_lock(&output_mutex);
+    if (status != 0)
+        err_abort(status, "Lock output mutex");
+    while (1)
+    {
+        while (output_head == NULL)
+        {
+            status = pthread_cond_wait(&output_ready, &output_mutex);
+            if (status != 0)
+                err_abort(status, "Wait on output ready");
+        }
+        batch = output_head;
+        for (count = 0, chunk = batch; count < OUTPUT_IOV && chunk != NULL; count++)
+        {
+            iov[count].iov_base = chunk->data;
+            iov[count].iov_len = chunk->length;
+            last = chunk;
+            chunk = chunk->next;
+        }
+        output_head = chunk;
+        if (output_head == NULL)
+            output_tail = NULL;
+        output_queued -= count;
+        output_writing = 1;
+        status = pthread_cond_broadcast(&output_space);
+        if (status != 0)
+            err_abort(status, "Broadcast output space");
+        status = pthread_mutex_unlock(&output_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock output mutex");
+
+        first = writes = 0;
+        while (first < count)
+        {
+            written = writev(STDOUT_FILENO, iov + first, count - first);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                errno_abort("Write output");
+            }
+            writes++;
+            while (first < count && (size_t)written >= iov[first].iov_len)
+                written -= iov[first++].iov_len;
+            if (first < count)
+            {
+                iov[first].iov_base = (char *)iov[first].iov_base + written;
+                iov[first].iov_len -= written;
+            }
+        }
+
+        status = pthread_mutex_lock(&output_mutex);
+        if (status != 0)
+            err_abort(status, "Lock output mutex");
+        last->next = output_free;
+        output_free = batch;
+        output_writes += writes;
+        output_writing = 0;
+        status = pthread_cond_broadcast(&output_space);
+        if (status != 0)
+            err_abort(status, "Broadcast output space");
+    }
+    return NULL;
+}
+
+/*
+ * Interned messages. Alarms with the same text share one message_t,
+ * which records how many references there are to it; the last
+ * release frees it. A message never changes once interned, so any
+ * thread holding a reference (an alarm on its way from the alarm
+ * thread through the consumer, the executor and a display list, or
+ * a server note) reads the text in place, with no lock and no copy.
+ * References only ever drop to zero under the stripe's mutex, which
+ * message_intern() also holds while it looks, so a message that is
+ * being freed can never be found and revived.
+ */
+static uint32_t message_hash(const char *text, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    return hash;
+}
+
+static message_stripe_t *message_stripe(uint32_t hash)
+{
+    return &message_stripes[hash >> 28 & (MESSAGE_STRIPES - 1)];
+}
+
+void message_init(void)
+{
+    int status, i;
+
+    for (i = 0; i < MESSAGE_STRIPES; i++)
+    {
+        status = pthread_mutex_init(&message_stripes[i].mutex, NULL);
+        if (status != 0)
+            err_abort(status, "Init message mutex");
+    }
+}
+
+static void message_lock(message_stripe_t *stripe)
+{
+    int status = pthread_mutex_lock(&stripe->mutex);
+
+    if (status != 0)
+        err_abort(status, "Lock message stripe");
+}
+
+static void message_unlock(message_stripe_t *stripe)
+{
+    int status = pthread_mutex_unlock(&stripe->mutex);
+
+    if (status != 0)
+        err_abort(status, "Unlock message stripe");
+}
+
+/*
+ * Double a stripe's buckets (or make its first ones). The caller
+ * holds its mutex.
+ */
+static void message_grow(message_stripe_t *stripe)
+{
+    message_t **bucket, *message, *next;
+    size_t buckets = stripe->bucket ? (stripe->mask + 1) * 2 : 256, i;
+
+    bucket = (message_t **)calloc(buckets, sizeof(message_t *));
+    if (bucket == NULL)
+        errno_abort("Allocate message table");
+    for (i = 0; stripe->bucket != NULL && i <= stripe->mask; i++)
+        for (message = stripe->bucket[i]; message != NULL; message = next)
+        {
+            next = message->next;
+            message->next = bucket[message->hash & (buckets - 1)];
+            bucket[message->hash & (buckets - 1)] = message;
+        }
+    free(stripe->bucket);
+    stripe->bucket = bucket;
+    stripe->mask = buckets - 1;
+}
+
+/*
+ * Return the message with the "length" bytes of "text", with a
+ * reference for the caller, interning it if it is new.
+ */
+message_t *message_intern(const char *text, size_t length)
+{
+    uint32_t hash = message_hash(text, length);
+    message_stripe_t *stripe = message_stripe(hash);
+    message_t *message;
+
+    atomic_fetch_add_explicit(&message_interns, 1, memory_order_relaxed);
+    message_lock(stripe);
+    if (stripe->bucket == NULL)
+        message_grow(stripe);
+    for (message = stripe->bucket[hash & stripe->mask]; message != NULL; message = message->next)
+        if (message->hash == hash && message->length == length
+            && memcmp(message->text, text, length) == 0)
+        {
+            atomic_fetch_add_explicit(&message->refs, 1, memory_order_relaxed);
+            message_unlock(stripe);
+            atomic_fetch_add_explicit(&message_shared, 1, memory_order_relaxed);
+            return message;
+        }
+    message = (message_t *)malloc(sizeof(message_t) + length + 1);
+    if (message == NULL)
+        errno_abort("Allocate message");
+    atomic_init(&message->refs, 1);
+    message->hash = hash;
+    message->length = (uint32_t)length;
+    memcpy(message->text, text, length);
+    message->text[length] = '\0';
+    if (stripe->count + 1 > stripe->mask + 1)
+        message_grow(stripe);
+    message->next = stripe->bucket[hash & stripe->mask];
+    stripe->bucket[hash & stripe->mask] = message;
+    stripe->count++;
+    message_unlock(stripe);
+    atomic_fetch_add_explicit(&message_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&message_bytes, length + 1, memory_order_relaxed);
+    return message;
+}
+
+/*
+ * Take another reference to a message the caller holds one to.
+ */
+message_t *message_hold(message_t *message)
+{
+    atomic_fetch_add_explicit(&message->refs, 1, memory_order_relaxed);
+    return message;
+}
+
+/*
+ * Drop a reference. Only the last one needs the stripe's mutex.
+ */
+void message_release(message_t *message)
+{
+    message_stripe_t *stripe;
+    message_t **link;
+    long refs = atomic_load_explicit(&message->refs, memory_order_relaxed);
+
+    while (refs > 1)
+        if (atomic_compare_exchange_weak_explicit(&message->refs, &refs, refs - 1,
+                                                  memory_order_release,
+                                                  memory_order_relaxed))
+            return;
+    stripe = message_stripe(message->hash);
+    message_lock(stripe);
+    if (atomic_fetch_sub_explicit(&message->refs, 1, memory_order_acq_rel) == 1)
+    {
+        for (link = &stripe->bucket[message->hash & stripe->mask]; *link != message;
+             link = &(*link)->next)
+            ;
+        *link = message->next;
+        stripe->count--;
+        atomic_fetch_sub_explicit(&message_count, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&message_bytes, message->length + 1, memory_order_relaxed);
+        free(message);
+    }
+    message_unlock(stripe);
+}
+
+alarm_t *alarm_alloc(void)
+{
+    alarm_pool_t *pool = alarm_pool;
+    alarm_t *alarm, *slab;
+    long in_use, high;
+    int i;
+
+    if (pool == NULL)
+    {
+        pool = (alarm_pool_t *)aligned_alloc(CACHE_LINE, sizeof(alarm_pool_t));
+        if (pool == NULL)
+            errno_abort("Allocate alarm pool");
+        pool->free_list = NULL;
+        atomic_init(&pool->remote, NULL);
+        alarm_pool = pool;
+    }
+    if (pool->free_list == NULL)
+        pool->free_list = atomic_exchange_explicit(&pool->remote, NULL,
+                                                   memory_order_acquire);
+    if (pool->free_list == NULL)
+    {
+        slab = (alarm_t *)aligned_alloc(CACHE_LINE, ALARM_SLAB * sizeof(alarm_t));
+        if (slab == NULL)
+            errno_abort("Allocate alarm slab");
+        for (i = 0; i < ALARM_SLAB; i++)
+        {
+            slab[i].pool = pool;
+            slab[i].link = i + 1 < ALARM_SLAB ? &slab[i + 1] : NULL;
+        }
+        pool->free_list = slab;
+        atomic_fetch_add_explicit(&pool_size, ALARM_SLAB, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pool_slabs, 1, memory_order_relaxed);
+    }
+    alarm = pool->free_list;
+    pool->free_list = alarm->link;
+    alarm->message = NULL;
+    alarm->owner = 0;
+    alarm->action = alarm_print;
+
+    in_use = atomic_fetch_add_explicit(&pool_in_use, 1, memory_order_relaxed) + 1;
+    high = atomic_load_explicit(&pool_high_water, memory_order_relaxed);
+    while (in_use > high
+           && !atomic_compare_exchange_weak_explicit(&pool_high_water, &high, in_use,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed))
+        ;
+    return alarm;
+}
+
+void alarm_free(alarm_t *alarm)
+{
+    alarm_pool_t *pool = alarm->pool;
+    alarm_t *head;
+
+    if (alarm->message != NULL)
+        message_release(alarm->message);
+    atomic_fetch_sub_explicit(&pool_in_use, 1, memory_order_relaxed);
+    if (pool == alarm_pool)
+    {
+        alarm->link = pool->free_list;
+        pool->free_list = alarm;
+        return;
+    }
+    head = atomic_load_explicit(&pool->remote, memory_order_relaxed);
+    do
+        alarm->link = head;
+    while (!atomic_compare_exchange_weak_explicit(&pool->remote, &head, alarm,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+}
+
+void buffer_init(circular_buffer_t *buffer, size_t slots, int producers)
+{
+    size_t i;
+
+    buffer->slot = (buffer_slot_t *)calloc(slots, sizeof(buffer_slot_t));
+    if (buffer->slot == NULL)
+        errno_abort("Allocate circular buffer");
+    for (i = 0; i < slots; i++)
+        atomic_init(&buffer->slot[i].seq, i);
+    buffer->mask = slots - 1;
+    buffer->multi_producer = producers > 1 || buffer_policy == BUFFER_DROP_OLDEST;
+    atomic_init(&buffer->head, 0);
+    atomic_init(&buffer->tail, 0);
+    buffer->head_cache = 0;
+    buffer->tail_cache = 0;
+    atomic_init(&buffer->sleeping, 0);
+    if (sem_init(&buffer->wakeup, 0, 0) != 0)
+        errno_abort("Init circular buffer semaphore");
+    atomic_init(&buffer->waiting, 0);
+    if (sem_init(&buffer->space, 0, 0) != 0)
+        errno_abort("Init circular buffer space semaphore");
+    atomic_init(&buffer->spill, NULL);
+    buffer->unspilled = NULL;
+}
+
+static size_t spsc_put(circular_buffer_t *buffer, alarm_t **alarms, size_t count)
+{
+    size_t tail, room, i;
+
+    tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    room = buffer->mask + 1 - (tail - buffer->head_cache);
+    if (room < count)
+    {
+        buffer->head_cache = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        room = buffer->mask + 1 - (tail - buffer->head_cache);
+    }
+    if (count > room)
+        count = room;
+    for (i = 0; i < count; i++)
+        buffer->slot[(tail + i) & buffer->mask].alarm = alarms[i];
+    atomic_store_explicit(&buffer->tail, tail + count, memory_order_release);
+    return count;
+}
+
+static size_t mpsc_put(circular_buffer_t *buffer, alarm_t **alarms, size_t count)
+{
+    size_t tail, seq, run, i;
+    buffer_slot_t *slot;
+
+    run = 0;
+    tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    while (count > 0)
+    {
+        /*
+         * Slots are not freed in order: a producer dropping the
+         * oldest alarms takes from head as the consumer does, and
+         * either may finish first. So check every slot of the run,
+         * and claim only the free ones at its start.
+         */
+        seq = tail;
+        for (run = 0; run < count; run++)
+        {
+            seq = atomic_load_explicit(&buffer->slot[(tail + run) & buffer->mask].seq,
+                                       memory_order_acquire);
+            if (seq != tail + run)
+                break;
+        }
+        if (run == 0 && (intptr_t)(seq - tail) < 0)
+            return 0; // full
+        if (run == 0)
+            tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+        else if (atomic_compare_exchange_weak_explicit(
+                     &buffer->tail, &tail, tail + run,
+                     memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+    for (i = 0; i < run; i++)
+    {
+        slot = &buffer->slot[(tail + i) & buffer->mask];
+        slot->alarm = alarms[i];
+        atomic_store_explicit(&slot->seq, tail + i + 1, memory_order_release);
+    }
+    return run;
+}
+
+/*
+ * Wake the consumer if it is asleep. Pairs with the fence in
+ * buffer_wait(): either the consumer sees the new alarms, or we
+ * see that it is sleeping.
+ */
+static void buffer_wake(circular_buffer_t *buffer)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&buffer->sleeping, memory_order_relaxed)
+        && atomic_exchange(&buffer->sleeping, 0))
+    {
+        if (sem_post(&buffer->wakeup) != 0)
+            errno_abort("Post circular buffer semaphore");
+    }
+}
+
+/*
+ * Append up to "count" alarms to the buffer and wake the consumer
+ * if it is asleep. Returns the number of alarms appended, which is
+ * less than "count" only if the buffer filled up.
+ */
+size_t buffer_put(circular_buffer_t *buffer, alarm_t **alarms, size_t count)
+{
+    if (buffer->multi_producer)
+        count = mpsc_put(buffer, alarms, count);
+    else
+        count = spsc_put(buffer, alarms, count);
+    if (count > 0)
+        buffer_wake(buffer);
+    return count;
+}
+
+/*
+ * Push alarms onto the overflow list, and wake the consumer.
+ */
+void buffer_spill(circular_buffer_t *buffer, alarm_t **alarms, size_t count)
+{
+    alarm_t *head;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        head = atomic_load(&buffer->spill);
+        do
+            alarms[i]->link = head;
+        while (!atomic_compare_exchange_weak(&buffer->spill, &head, alarms[i]));
+    }
+    atomic_fetch_add_explicit(&buffer->spilled, count, memory_order_relaxed);
+    buffer_wake(buffer);
+}
+
+/*
+ * Claim up to "max" filled slots at head by compare-and-swap, so
+ * that a producer dropping the oldest alarms and the consumer can
+ * both take. Multi-producer protocol only.
+ */
+static size_t mpmc_take(circular_buffer_t *buffer, alarm_t **alarms, size_t max)
+{
+    size_t head, count, i;
+    buffer_slot_t *slot;
+
+    head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    do
+    {
+        for (count = 0; count < max; count++)
+            if (atomic_load_explicit(&buffer->slot[(head + count) & buffer->mask].seq,
+                                     memory_order_acquire) != head + count + 1)
+                break;
+        if (count == 0)
+            return 0;
+    } while (!atomic_compare_exchange_weak_explicit(&buffer->head, &head, head + count,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+    for (i = 0; i < count; i++)
+    {
+        slot = &buffer->slot[(head + i) & buffer->mask];
+        alarms[i] = slot->alarm;
+        atomic_store_explicit(&slot->seq, head + i + buffer->mask + 1,
+                              memory_order_release);
+    }
+    return count;
+}
+
+/*
+ * Let producers blocked for room know there may be some. Pairs with
+ * the fence in buffer_push(): either they see the freed slots, or we
+ * see them waiting.
+ */
+static void buffer_release(circular_buffer_t *buffer)
+{
+    int waiting;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    waiting = atomic_load_explicit(&buffer->waiting, memory_order_relaxed);
+    while (waiting-- > 0)
+        if (sem_post(&buffer->space) != 0)
+            errno_abort("Post circular buffer space semaphore");
+}
+
+/*
+ * Take up to "max" alarms from the buffer, oldest first, and then
+ * from the overflow list. Only the consumer thread may call this.
+ */
+size_t buffer_get(circular_buffer_t *buffer, alarm_t **alarms, size_t max)
+{
+    size_t head, count, i;
+    alarm_t *alarm, *next;
+
+    // Overflow taken earlier is older than anything now in the ring.
+    if (buffer->unspilled != NULL)
+    {
+        for (count = 0; count < max && buffer->unspilled != NULL; count++)
+        {
+            alarms[count] = buffer->unspilled;
+            buffer->unspilled = buffer->unspilled->link;
+        }
+        return count;
+    }
+
+    if (buffer->multi_producer)
+        count = mpmc_take(buffer, alarms, max);
+    else
+    {
+        head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+        count = buffer->tail_cache - head;
+        if (count < max)
+        {
+            buffer->tail_cache = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+            count = buffer->tail_cache - head;
+        }
+        if (count > max)
+            count = max;
+        for (i = 0; i < count; i++)
+            alarms[i] = buffer->slot[(head + i) & buffer->mask].alarm;
+        atomic_store_explicit(&buffer->head, head + count, memory_order_release);
+    }
+    if (count > 0)
+    {
+        buffer_release(buffer);
+        return count;
+    }
+
+    // The ring is empty: take the overflow, and put it back in order.
+    alarm = atomic_exchange(&buffer->spill, NULL);
+    for (; alarm != NULL; alarm = next)
+    {
+        next = alarm->link;
+        alarm->link = buffer->unspilled;
+        buffer->unspilled = alarm;
+    }
+    return buffer->unspilled != NULL ? buffer_get(buffer, alarms, max) : 0;
+}
+
+static int buffer_empty(circular_buffer_t *buffer)
+{
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+
+    if (buffer->unspilled != NULL || atomic_load(&buffer->spill) != NULL)
+        return 0;
+    if (buffer->multi_producer)
+        return atomic_load_explicit(&buffer->slot[head & buffer->mask].seq,
+                                    memory_order_acquire) != head + 1;
+    return atomic_load_explicit(&buffer->tail, memory_order_acquire) == head;
+}
+
+/*
+ * Put the consumer to sleep until a producer adds something. A
+ * stale wakeup left over from a race is harmless: the consumer just
+ * finds the buffer empty and comes back.
+ */
+void buffer_wait(circular_buffer_t *buffer)
+{
+    atomic_store(&buffer->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (buffer_empty(buffer))
+    {
+        while (sem_wait(&buffer->wakeup) != 0)
+            if (errno != EINTR)
+                errno_abort("Wait on circular buffer semaphore");
+    }
+    atomic_store(&buffer->sleeping, 0);
+}
+
+/*
+ * The shard that owns an alarm_id.
+ */
+alarm_shard_t *shard_of(int alarm_id)
+{
+    return &alarm_shards[(uint64_t)(uint32_t)index_hash(alarm_id)
+                         * alarm_shard_count >> 32];
+}
+
+/*
+ * The display list that owns an alarm_id.
+ */
+alarm_display_t *display_of(int alarm_id)
+{
+    return &alarm_displays[(uint64_t)(uint32_t)index_hash(alarm_id)
+                           * alarm_display_count >> 32];
+}
+
+/*
+ * Lock a display list, and move its inbox onto it.
+ */
+void display_lock(alarm_display_t *display)
+{
+    alarm_time_t start = stats_enabled ? alarm_now() : 0;
+    alarm_t *alarm, *next;
+    int status;
+
+    status = pthread_mutex_lock(&display->mutex);
+    if (status != 0)
+        err_abort(status, "Lock alarm display list mutex");
+    lock_stats_acquire(&display->lock_stats, start);
+    for (alarm = atomic_exchange(&display->inbox, NULL); alarm != NULL; alarm = next)
+    {
+        next = alarm->link;
+        heap_push(&display->list, alarm);
+        index_put(&display->index, alarm);
+    }
+}
+
+void display_unlock(alarm_display_t *display)
+{
+    int status;
+
+    lock_stats_release(&display->lock_stats);
+    status = pthread_mutex_unlock(&display->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock alarm display list mutex");
+}
+
+/*
+ * Hand a periodic alarm to its display thread without locking. The
+ * push and the deadline load here, and the deadline store and
+ * inbox load in periodic_display_thread(), are sequentially
+ * consistent, so either we see the thread's new deadline or it sees
+ * our alarm before it sleeps.
+ */
+void display_post(alarm_t *alarm)
+{
+    alarm_display_t *display = display_of(alarm->alarm_id);
+    alarm_time_t deadline;
+
+    alarm->link = atomic_load(&display->inbox);
+    while (!atomic_compare_exchange_weak(&display->inbox, &alarm->link, alarm))
+        ;
+    deadline = atomic_load(&display->deadline);
+    if (deadline == 0 || alarm->scheduled_time < deadline)
+    {
+        if (sem_post(&display->wakeup) != 0)
+            errno_abort("Post display wakeup");
+    }
+}
+
+/*
+ * Adaptive spin. The alarm thread blocks until spin_window() before
+ * its deadline, then spins (with the shard unlocked) to the
+ * deadline itself, so a wakeup up to a window late costs nothing.
+ * After each blocking wait spin_tune() records how late the wakeup
+ * was. In "adaptive" mode a wakeup later than the window widens it
+ * by 1/8, and any other narrows it by 1/512, so the window settles
+ * where about one wakeup in 65 overruns it: near the 98.5th
+ * percentile of the lateness the thread sees, and no wider. A lone
+ * outlier (a preempted thread, say) moves it by only an eighth.
+ *
+ * A deadline already inside the window is spun to without a wait,
+ * which says nothing about wakeups; spin_skip() counts it as on
+ * time. Otherwise closely spaced alarms would keep a wide window
+ * from ever seeing the waits that narrow it, and the thread would
+ * spin nearly all the time. A wait that times out also ends inside
+ * the window, but spin_tune() has counted it already, so the spin
+ * that follows is not counted again. The caller holds the shard's
+ * mutex.
+ */
+static alarm_time_t spin_window(alarm_shard_t *shard)
+{
+    if (spin_mode == SPIN_FIXED)
+        return spin_fixed;
+    if (spin_mode == SPIN_ADAPTIVE)
+        return shard->spin_window;
+    return 0;
+}
+
+static void spin_tune(alarm_shard_t *shard, alarm_time_t late)
+{
+    histogram_record(&shard->wakeup_late, late > 0 ? late : 0);
+    if (spin_mode != SPIN_ADAPTIVE)
+        return;
+    if (late > shard->spin_window)
+    {
+        shard->spin_window += shard->spin_window / 8;
+        if (shard->spin_window > SPIN_MAX)
+            shard->spin_window = SPIN_MAX;
+    }
+    else if (shard->spin_window - shard->spin_window / 512 > SPIN_MIN)
+        shard->spin_window -= shard->spin_window / 512;
+}
+
+static void spin_skip(alarm_shard_t *shard)
+{
+    if (spin_mode == SPIN_ADAPTIVE
+        && shard->spin_window - shard->spin_window / 512 > SPIN_MIN)
+        shard->spin_window -= shard->spin_window / 512;
+}
+
+/*
+ * Spin, without the shard's mutex, until "deadline" or until
+ * alarm_wake() has an earlier alarm for us. While as many alarm
+ * threads spin as there are CPUs, each yields between polls rather
+ * than keep the consumer and executors, or the other shards'
+ * wakeups, off the CPU. The caller holds the mutex, and has it
+ * again on return.
+ */
+static void shard_spin(alarm_shard_t *shard, alarm_time_t deadline)
+{
+    alarm_time_t start = alarm_now(), now = start;
+
+    atomic_store(&shard->spinning, 1);
+    atomic_fetch_add(&spin_threads, 1);
+    shard_unlock(shard);
+    while (now < deadline && atomic_load_explicit(&shard->spinning, memory_order_relaxed))
+    {
+        // With a spinner on every CPU, the threads we are waiting
+        // for (or whose wakeups we measure) could not run.
+        if (atomic_load_explicit(&spin_threads, memory_order_relaxed) >= spin_cpus)
+            sched_yield();
+        else
+            cpu_relax();
+        now = alarm_now();
+    }
+    atomic_fetch_sub(&spin_threads, 1);
+    shard_lock(shard);
+    atomic_store(&shard->spinning, 0);
+    shard->spins++;
+    shard->spin_time += now - start;
+}
+
+/*
+ * Arm a shard's timerfd to fire the spin window before "when" (0
+ * disarms it). A target already past fires at once, so its
+ * lateness counts from now.
+ */
+static void timer_arm(alarm_shard_t *shard, alarm_time_t when)
+{
+    struct itimerspec spec;
+    alarm_time_t now;
+
+    shard->wait_target = when;
+    if (when != 0 && spin_mode != SPIN_OFF)
+    {
+        when -= spin_window(shard);
+        now = alarm_now();
+        shard->wait_target = when > now ? when : now;
+    }
+    memset(&spec, 0, sizeof(spec));
+    alarm_timespec(when, &spec.it_value);
+    if (timerfd_settime(shard->timer.fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+        errno_abort("Arm timerfd");
+}
+
+/*
+ * Watch another file descriptor from an "epoll" engine loop.
+ */
+void event_loop_add(alarm_shard_t *shard, event_source_t *source, uint32_t events)
+{
+    struct epoll_event event;
+
+    event.events = events;
+    event.data.ptr = source;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, source->fd, &event) != 0)
+        errno_abort("Add epoll source");
+}
+
+static void timer_handler(event_source_t *source, uint32_t events);
+
+void event_loop_init(alarm_shard_t *shard)
+{
+    shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (shard->epoll_fd < 0)
+        errno_abort("Create epoll fd");
+    shard->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (shard->timer.fd < 0)
+        errno_abort("Create timerfd");
+    shard->timer.handler = timer_handler;
+    shard->timer.arg = shard;
+    event_loop_add(shard, &shard->timer, EPOLLIN);
+}
+
+// Alarm system initialization
+void initialize_alarm_system(const alarm_backend_t *backend, int shards, int displays,
+                             int workers)
+{
+    int status, i;
+    pthread_condattr_t attr;
+    alarm_shard_t *shard;
+
+    /*
+     * The alarm threads' timed waits are absolute CLOCK_MONOTONIC
+     * times, so the condition variables must use that clock.
+     */
+    status = pthread_condattr_init(&attr);
+    if (status != 0)
+        err_abort(status, "Init condattr");
+    status = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (status != 0)
+        err_abort(status, "Set condattr clock");
+
+    message_init();
+    spin_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (spin_cpus < 1)
+        spin_cpus = 1;
+
+    // Alarm shard initialization
+    alarm_shards = (alarm_shard_t *)calloc(shards, sizeof(alarm_shard_t));
+    if (alarm_shards == NULL)
+        errno_abort("Allocate alarm shards");
+    alarm_shard_count = shards;
+    for (i = 0; i < shards; i++)
+    {
+        shard = &alarm_shards[i];
+        status = pthread_mutex_init(&shard->mutex, NULL);
+        if (status != 0)
+            err_abort(status, "Init mutex");
+        status = pthread_cond_init(&shard->cond, &attr);
+        if (status != 0)
+            err_abort(status, "Init cond");
+        shard->store.backend = backend;
+        shard->store.count = 0;
+        shard->spin_window = spin_mode == SPIN_FIXED ? spin_fixed : SPIN_START;
+        index_init(&shard->store.index, 1024);
+        backend->init(&shard->store);
+        if (alarm_engine == ENGINE_EPOLL)
+            event_loop_init(shard);
+    }
+
+    // Every shard's alarm thread produces into the circular buffer.
+    buffer_init(&alarm_buffer, BUFFER_SLOTS, shards);
+
+    pthread_condattr_destroy(&attr);
+
+    // Alarm display list initialization
+    alarm_displays = (alarm_display_t *)calloc(displays, sizeof(alarm_display_t));
+    if (alarm_displays == NULL)
+        errno_abort("Allocate alarm display lists");
+    alarm_display_count = displays;
+    for (i = 0; i < displays; i++)
+    {
+        status = pthread_mutex_init(&alarm_displays[i].mutex, NULL);
+        if (status != 0)
+            err_abort(status, "Initializing alarm display list mutex");
+        index_init(&alarm_displays[i].index, 1024);
+        if (sem_init(&alarm_displays[i].wakeup, 0, 0) != 0)
+            errno_abort("Init display wakeup");
+    }
+
+    // Executor initialization
+    executor_workers = (executor_worker_t *)calloc(workers, sizeof(executor_worker_t));
+    if (executor_workers == NULL)
+        errno_abort("Allocate executor workers");
+    executor_count = workers;
+    for (i = 0; i < workers; i++)
+    {
+        status = pthread_mutex_init(&executor_workers[i].mutex, NULL);
+        if (status != 0)
+            err_abort(status, "Init executor mutex");
+        executor_workers[i].capacity = CONSUMER_BATCH * 4;
+        executor_workers[i].deque = (alarm_t **)malloc(
+            executor_workers[i].capacity * sizeof(alarm_t *));
+        if (executor_workers[i].deque == NULL)
+            errno_abort("Allocate executor deque");
+    }
+    if (sem_init(&executor_work, 0, 0) != 0)
+        errno_abort("Init executor semaphore");
+}
+
+/*
+ * Wake the shard's alarm thread if it is not busy (that is, if
+ * current_alarm is 0, signifying that it's waiting for
+ * work), or if "when" comes before the time for which the
+ * alarm thread is waiting. The "epoll" engine needs no
+ * wakeup: re-arming the timerfd is enough. The caller must
+ * hold the shard's mutex.
+ */
+static void alarm_wake(alarm_shard_t *shard, alarm_time_t when)
+{
+    int status;
+
+    if (shard->current_alarm == 0 || when < shard->current_alarm)
+    {
+        if (shard->current_alarm != 0)
+            shard->requeues++;
+        shard->current_alarm = when;
+        atomic_store_explicit(&shard->spinning, 0, memory_order_relaxed);
+        if (alarm_engine == ENGINE_EPOLL)
+        {
+            timer_arm(shard, when);
+            return;
+        }
+        status = pthread_cond_signal(&shard->cond);
+        if (status != 0)
+            err_abort(status, "Signal cond");
+    }
+}
+
+/*
+ * Insert alarm entry into its shard's alarm store.
+ */
+void alarm_insert(alarm_t *alarm)
+{
+    alarm_shard_t *shard = shard_of(alarm->alarm_id);
+
+    /*
+     * LOCKING PROTOCOL:
+     *
+     * This routine requires that the caller have locked the
+     * mutex of the alarm's shard (shard_of(alarm->alarm_id))!
+     */
+    store_add(&shard->store, alarm);
+#ifdef DEBUG
+    printf("[%s: %d alarms, +%lld(%lld)[\"%s\"]]\n",
+           shard->store.backend->name, shard->store.count,
+           (long long)alarm->scheduled_time,
+           (long long)(alarm->scheduled_time - alarm_now()), alarm->message->text);
+#endif
+    alarm_wake(shard, alarm->scheduled_time);
+}
+
+
+/*
+ * Persistence ("-d dir"). Every insert, change and cancel, and the
+ * firing of every one-shot alarm, is appended to a write-ahead log
+ * of fixed-size records in dir/log.<segment>. Appending only copies
+ * the record into memory. The WAL thread writes and fdatasync()s
+ * whatever has accumulated while its last sync ran, so concurrent
+ * commits share one sync (group commit), and wal_sync() waits for
+ * the records appended so far. When a segment reaches WAL_SEGMENT
+ * bytes, a new one is started and the snapshot thread folds the
+ * closed segments into dir/snapshot: a header and then one record
+ * per pending alarm, which is read with mmap(). A restart reads the
+ * snapshot and the segments written since it, never the whole
+ * history. Deadlines are logged on CLOCK_REALTIME, since
+ * CLOCK_MONOTONIC does not survive a reboot. A message too long for
+ * one record goes on in WAL_MORE records straight after it; a
+ * record's message is NUL-terminated unless it goes on.
+ */
+#define WAL_INSERT 1
+#define WAL_CHANGE 2
+#define WAL_CANCEL 3
+#define WAL_DONE 4               // a one-shot alarm fired
+#define WAL_MORE 5               // more of the message of the record before
+#define WAL_SEGMENT (64 << 20)   // bytes per log segment
+#define WAL_MAGIC "ALARMSNP"
+
+typedef struct wal_record_tag
+{
+    uint32_t type;
+    int32_t alarm_id;
+    int32_t periodic;
+    uint32_t check;   // FNV-1a of the record, taken with check 0
+    int64_t interval;
+    int64_t due;      // CLOCK_REALTIME nanoseconds
+    int64_t slack;
+    char message[88];
+} wal_record_t;
+
+#define WAL_TEXT sizeof(((wal_record_t *)0)->message) // message bytes per record
+#define WAL_PARTS (MESSAGE_MAX / WAL_TEXT + 1)        // most records one change takes
+
+typedef struct wal_snapshot_tag
+{
+    char magic[8];
+    int64_t segment;       // last log segment folded in
+    int64_t count;         // records that follow
+    int32_t next_alarm_id;
+    char pad[sizeof(wal_record_t) - 28]; // records stay aligned
+} wal_snapshot_t;
+
+const char *wal_dir;                // NULL: no persistence
+int wal_fd = -1;                    // current segment; WAL thread only
+int64_t wal_segment;                // its number
+size_t wal_segment_bytes;           // bytes written to it
+alarm_time_t wal_clock_offset;      // CLOCK_REALTIME - CLOCK_MONOTONIC
+pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wal_work = PTHREAD_COND_INITIALIZER;   // records appended
+pthread_cond_t wal_synced = PTHREAD_COND_INITIALIZER; // wal_durable advanced
+pthread_cond_t wal_fold = PTHREAD_COND_INITIALIZER;   // wal_fold_target advanced
+wal_record_t *wal_pending, *wal_spare; // appended but not written; spare buffer
+size_t wal_pending_count, wal_pending_capacity, wal_spare_capacity;
+long wal_appended, wal_durable;     // records appended, and synced
+int64_t wal_folded, wal_fold_target; // segments in the snapshot, and wanted there
+
+static uint32_t wal_check(const wal_record_t *record)
+{
+    const unsigned char *p = (const unsigned char *)record;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(*record); i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+static void wal_path(char *path, size_t size, int64_t segment)
+{
+    if (segment < 0)
+        snprintf(path, size, "%s/snapshot", wal_dir);
+    else
+        snprintf(path, size, "%s/log.%08lld", wal_dir, (long long)segment);
+}
+
+static void wal_sync_dir(void)
+{
+    int fd = open(wal_dir, O_RDONLY);
+
+    if (fd < 0 || fsync(fd) != 0)
+        errno_abort("Sync log directory");
+    close(fd);
+}
+
+static void wal_write(int fd, const void *data, size_t length)
+{
+    ssize_t written;
+
+    while (length > 0)
+    {
+        written = write(fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Write log");
+        }
+        data = (const char *)data + written;
+        length -= written;
+    }
+}
+
+/*
+ * Encode "alarm", due at "due", as a record of "type" and the
+ * WAL_MORE records its message needs, at "record". Cancels and
+ * firings log no message. Returns the number of records, at most
+ * WAL_PARTS.
+ */
+static size_t wal_encode(wal_record_t *record, int type, const alarm_t *alarm, int64_t due)
+{
+    const char *text = alarm->message->text;
+    size_t left = alarm->message->length, part, count = 0;
+
+    if (type == WAL_CANCEL || type == WAL_DONE)
+        left = 0;
+    do
+    {
+        memset(&record[count], 0, sizeof(record[count]));
+        record[count].type = count == 0 ? type : WAL_MORE;
+        record[count].alarm_id = alarm->alarm_id;
+        record[count].periodic = alarm->periodic;
+        record[count].interval = alarm->interval;
+        record[count].due = due;
+        record[count].slack = alarm->slack;
+        part = left < WAL_TEXT ? left : WAL_TEXT;
+        memcpy(record[count].message, text, part);
+        text += part;
+        left -= part;
+        record[count].check = wal_check(&record[count]);
+        count++;
+    } while (part == WAL_TEXT);
+    return count;
+}
+
+/*
+ * Append the records for "alarm". Callers hold the lock that orders
+ * the change, so the log orders changes to one alarm the same way.
+ */
+void wal_log(int type, const alarm_t *alarm)
+{
+    size_t count;
+    int status;
+
+    if (wal_dir == NULL)
+        return;
+    status = pthread_mutex_lock(&wal_mutex);
+    if (status != 0)
+        err_abort(status, "Lock log mutex");
+    if (wal_pending_count + WAL_PARTS > wal_pending_capacity)
+    {
+        wal_pending_capacity = wal_pending_capacity ? wal_pending_capacity * 2 : 1024;
+        wal_pending = (wal_record_t *)realloc(
+            wal_pending, wal_pending_capacity * sizeof(wal_record_t));
+        if (wal_pending == NULL)
+            errno_abort("Grow log buffer");
+    }
+    count = wal_encode(&wal_pending[wal_pending_count], type, alarm,
+                       alarm->scheduled_time + wal_clock_offset);
+    wal_pending_count += count;
+    wal_appended += count;
+    status = pthread_cond_signal(&wal_work);
+    if (status != 0)
+        err_abort(status, "Signal log work");
+    status = pthread_mutex_unlock(&wal_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock log mutex");
+}
+
+/*
+ * Wait until every record appended so far is on disk.
+ */
+void wal_sync(void)
+{
+    long target;
+    int status;
+
+    if (wal_dir == NULL)
+        return;
+    status = pthread_mutex_lock(&wal_mutex);
+    if (status != 0)
+        err_abort(status, "Lock log mutex");
+    target = wal_appended;
+    while (wal_durable < target)
+    {
+        status = pthread_cond_wait(&wal_synced, &wal_mutex);
+        if (status != 0)
+            err_abort(status, "Wait for log sync");
+    }
+    status = pthread_mutex_unlock(&wal_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock log mutex");
+}
+
+static void wal_open_segment(int64_t segment)
+{
+    char path[4096];
+
+    wal_path(path, sizeof(path), segment);
+    wal_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (wal_fd < 0)
+        errno_abort("Open log segment");
+    wal_sync_dir();
+    wal_segment = segment;
+    wal_segment_bytes = 0;
+}
+
+/*
+ * The WAL thread's start routine: the group commit loop.
+ */
+void *wal_thread(void *arg)
+{
+    wal_record_t *batch;
+    size_t count, capacity;
+    long target;
+    int status, rotated;
+
+    status = pthread_mutex_lock(&wal_mutex);
+    if (status != 0)
+        err_abort(status, "Lock log mutex");
+    while (1)
+    {
+        while (wal_pending_count == 0)
+        {
+            status = pthread_cond_wait(&wal_work, &wal_mutex);
+            if (status != 0)
+                err_abort(status, "Wait for log work");
+        }
+        batch = wal_pending;
+        count = wal_pending_count;
+        capacity = wal_pending_capacity;
+        target = wal_appended;
+        wal_pending = wal_spare;
+        wal_pending_capacity = wal_spare_capacity;
+        wal_pending_count = 0;
+        status = pthread_mutex_unlock(&wal_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock log mutex");
+
+        wal_write(wal_fd, batch, count * sizeof(wal_record_t));
+        if (fdatasync(wal_fd) != 0)
+            errno_abort("Sync log");
+        wal_segment_bytes += count * sizeof(wal_record_t);
+        rotated = wal_segment_bytes >= WAL_SEGMENT;
+        if (rotated)
+        {
+            close(wal_fd);
+            wal_open_segment(wal_segment + 1);
+        }
+
+        status = pthread_mutex_lock(&wal_mutex);
+        if (status != 0)
+            err_abort(status, "Lock log mutex");
+        wal_spare = batch;
+        wal_spare_capacity = capacity;
+        wal_durable = target;
+        status = pthread_cond_broadcast(&wal_synced);
+        if (status != 0)
+            err_abort(status, "Broadcast log sync");
+        if (rotated)
+        {
+            wal_fold_target = wal_segment - 1;
+            status = pthread_cond_signal(&wal_fold);
+            if (status != 0)
+                err_abort(status, "Signal log fold");
+        }
+    }
+    return NULL;
+}
+
+static int wal_valid(const wal_record_t *record);
+
+/*
+ * Apply the record at "record", with the WAL_MORE records that go
+ * on with it, to "index", a table of malloc'd alarms whose
+ * scheduled_time is a CLOCK_REALTIME deadline. Returns the number
+ * of records used, or 0 if the "count" records there end, or are
+ * torn, before its message does.
+ */
+static size_t wal_apply(alarm_index_t *index, const wal_record_t *record, size_t count,
+                        int *next_id)
+{
+    alarm_t *alarm = index_get(index, record->alarm_id);
+    char text[MESSAGE_MAX];
+    size_t length = 0, part, used = 0;
+
+    do
+    {
+        if (used == count
+            || (used > 0 && (record[used].type != WAL_MORE || !wal_valid(&record[used]))))
+            return 0;
+        part = strnlen(record[used].message, WAL_TEXT);
+        memcpy(text + length, record[used].message,
+               part < MESSAGE_MAX - length ? part : MESSAGE_MAX - length);
+        length += part < MESSAGE_MAX - length ? part : MESSAGE_MAX - length;
+        used++;
+    } while (part == WAL_TEXT);
+
+    if (record->alarm_id >= *next_id)
+        *next_id = record->alarm_id + 1;
+    if (record->type == WAL_CANCEL || record->type == WAL_DONE)
+    {
+        if (alarm != NULL)
+        {
+            index_delete(index, record->alarm_id);
+            message_release(alarm->message);
+            free(alarm);
+        }
+        return used;
+    }
+    if (alarm == NULL)
+    {
+        alarm = (alarm_t *)aligned_alloc(CACHE_LINE, sizeof(alarm_t));
+        if (alarm == NULL)
+            errno_abort("Allocate recovered alarm");
+        memset(alarm, 0, sizeof(alarm_t));
+        alarm->alarm_id = record->alarm_id;
+        index_put(index, alarm);
+    }
+    alarm->periodic = record->periodic;
+    alarm->interval = record->interval;
+    alarm->scheduled_time = record->due;
+    alarm->slack = record->slack;
+    if (alarm->message != NULL)
+        message_release(alarm->message);
+    alarm->message = message_intern(text, length);
+    return used;
+}
+
+static int wal_valid(const wal_record_t *record)
+{
+    wal_record_t copy = *record;
+
+    copy.check = 0;
+    return wal_check(&copy) == record->check;
+}
+
+/*
+ * Map a file. Returns 0 if it does not exist.
+ */
+static int wal_map(const char *path, void **data, size_t *size)
+{
+    struct stat info;
+    int fd;
+
+    *data = NULL;
+    *size = 0;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+        errno_abort("Open log file");
+    }
+    if (fstat(fd, &info) != 0)
+        errno_abort("Stat log file");
+    *size = info.st_size;
+    if (*size > 0)
+    {
+        *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*data == MAP_FAILED)
+            errno_abort("Map log file");
+    }
+    close(fd);
+    return 1;
+}
+
+/*
+ * Read the snapshot, then the log segments after it, up to "upto"
+ * (every one there is, if upto is 0), into "index". Returns the last
+ * segment read, and the snapshot's in *snapshot_segment.
+ */
+static int64_t wal_load(alarm_index_t *index, int64_t upto,
+                        int64_t *snapshot_segment, int *next_id)
+{
+    const wal_snapshot_t *snapshot;
+    const wal_record_t *record;
+    char path[4096];
+    void *data;
+    size_t size, count, used, i;
+    int64_t segment;
+
+    *snapshot_segment = 0;
+    wal_path(path, sizeof(path), -1);
+    if (wal_map(path, &data, &size))
+    {
+        snapshot = (const wal_snapshot_t *)data;
+        if (size < sizeof(*snapshot) || memcmp(snapshot->magic, WAL_MAGIC, 8) != 0
+            || size != sizeof(*snapshot) + snapshot->count * sizeof(wal_record_t))
+        {
+            fprintf(stderr, "%s: not a snapshot\n", path);
+            exit(1);
+        }
+        *snapshot_segment = snapshot->segment;
+        if (snapshot->next_alarm_id > *next_id)
+            *next_id = snapshot->next_alarm_id;
+        record = (const wal_record_t *)(snapshot + 1);
+        for (i = 0; i < (size_t)snapshot->count; i += used)
+        {
+            used = wal_apply(index, &record[i], snapshot->count - i, next_id);
+            if (used == 0)
+            {
+                fprintf(stderr, "%s: message cut short\n", path);
+                exit(1);
+            }
+        }
+        munmap(data, size);
+    }
+
+    for (segment = *snapshot_segment + 1; upto == 0 || segment <= upto; segment++)
+    {
+        wal_path(path, sizeof(path), segment);
+        if (!wal_map(path, &data, &size))
+            break;
+        record = (const wal_record_t *)data;
+        count = size / sizeof(wal_record_t);
+        // A crash can leave a torn record at the end of the last segment.
+        for (i = 0; i < count && wal_valid(&record[i]); i += used)
+        {
+            used = wal_apply(index, &record[i], count - i, next_id);
+            if (used == 0)
+                break;
+        }
+        if (i < count || size % sizeof(wal_record_t) != 0)
+            fprintf(stderr, "%s: ignoring torn records after %zu\n", path, i);
+        if (data != NULL)
+            munmap(data, size);
+    }
+    return segment - 1;
+}
+
+static void wal_free_index(alarm_index_t *index)
+{
+    size_t i;
+
+    for (i = 0; i <= index->mask; i++)
+        if (index->bucket[i].alarm != NULL)
+        {
+            message_release(index->bucket[i].alarm->message);
+            free(index->bucket[i].alarm);
+        }
+    free(index->bucket);
+}
+
+/*
+ * Fold the log segments up to "upto" into a new snapshot, written
+ * beside the old one and renamed over it, then remove them. This
+ * reads only files, so it never touches the scheduler.
+ */
+static void wal_compact(int64_t upto)
+{
+    alarm_index_t index;
+    wal_snapshot_t header;
+    wal_record_t chunk[256];
+    alarm_t *saved;
+    char path[4096], temp[4096];
+    int64_t snapshot_segment, segment;
+    size_t i, count = 0;
+    int fd, next_id = 1;
+
+    index_init(&index, 1024);
+    segment = wal_load(&index, upto, &snapshot_segment, &next_id);
+    snprintf(temp, sizeof(temp), "%s/snapshot.tmp", wal_dir);
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        errno_abort("Create snapshot");
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WAL_MAGIC, 8);
+    header.segment = segment;
+    header.next_alarm_id = next_id;
+    // One record per alarm, and one per WAL_TEXT bytes of long messages.
+    for (i = 0; i <= index.mask; i++)
+        if (index.bucket[i].alarm != NULL)
+            header.count += index.bucket[i].alarm->message->length / WAL_TEXT + 1;
+    wal_write(fd, &header, sizeof(header));
+    for (i = 0; i <= index.mask; i++)
+    {
+        saved = index.bucket[i].alarm;
+        if (saved == NULL)
+            continue;
+        if (count + WAL_PARTS > sizeof(chunk) / sizeof(chunk[0]))
+        {
+            wal_write(fd, chunk, count * sizeof(chunk[0]));
+            count = 0;
+        }
+        count += wal_encode(&chunk[count], WAL_INSERT, saved, saved->scheduled_time);
+    }
+    wal_write(fd, chunk, count * sizeof(chunk[0]));
+    if (fsync(fd) != 0)
+        errno_abort("Sync snapshot");
+    close(fd);
+    wal_path(path, sizeof(path), -1);
+    if (rename(temp, path) != 0)
+        errno_abort("Install snapshot");
+    wal_sync_dir();
+    for (; segment > snapshot_segment; segment--)
+    {
+        wal_path(path, sizeof(path), segment);
+        unlink(path);
+    }
+    wal_free_index(&index);
+}
+
+/*
+ * The snapshot thread's start routine.
+ */
+void *wal_snapshot_thread(void *arg)
+{
+    int64_t target;
+    int status;
+
+    status = pthread_mutex_lock(&wal_mutex);
+    if (status != 0)
+        err_abort(status, "Lock log mutex");
+    while (1)
+    {
+        while (wal_folded >= wal_fold_target)
+        {
+            status = pthread_cond_wait(&wal_fold, &wal_mutex);
+            if (status != 0)
+                err_abort(status, "Wait for log fold");
+        }
+        target = wal_fold_target;
+        status = pthread_mutex_unlock(&wal_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock log mutex");
+        wal_compact(target);
+        status = pthread_mutex_lock(&wal_mutex);
+        if (status != 0)
+            err_abort(status, "Lock log mutex");
+        wal_folded = target;
+    }
+    return NULL;
+}
+
+/*
+ * Recover the alarms in wal_dir into the (empty) stores, then start
+ * logging to a new segment. Alarms keep their ids; a periodic alarm
+ * whose deadline passed while we were down moves on to the next
+ * point of its grid, and an overdue one-shot alarm fires at once.
+ */
+void wal_open(void)
+{
+    alarm_index_t index;
+    alarm_shard_t *shard;
+    alarm_t *alarm, *saved;
+    alarm_time_t start = alarm_now(), now;
+    struct timespec realtime;
+    pthread_t thread;
+    char path[4096];
+    int64_t segment, snapshot_segment, old;
+    size_t i;
+    int status, next_id = 1;
+
+    if (clock_gettime(CLOCK_REALTIME, &realtime) != 0)
+        errno_abort("Get real time");
+    now = alarm_now();
+    wal_clock_offset = (alarm_time_t)realtime.tv_sec * NSEC_PER_SEC
+                       + realtime.tv_nsec - now;
+
+    index_init(&index, 1024);
+    segment = wal_load(&index, 0, &snapshot_segment, &next_id);
+    // Segments an interrupted fold left behind.
+    for (old = snapshot_segment; old > 0; old--)
+    {
+        wal_path(path, sizeof(path), old);
+        if (unlink(path) != 0)
+            break;
+    }
+    for (i = 0; i <= index.mask; i++)
+    {
+        saved = index.bucket[i].alarm;
+        if (saved == NULL)
+            continue;
+        alarm = alarm_alloc();
+        alarm->alarm_id = saved->alarm_id;
+        alarm->periodic = saved->periodic;
+        alarm->interval = saved->interval;
+        alarm->slack = saved->slack;
+        alarm->message = message_hold(saved->message);
+        alarm->scheduled_time = saved->scheduled_time - wal_clock_offset;
+        if (alarm->periodic && alarm->interval > 0 && alarm->scheduled_time < now)
+            alarm->scheduled_time += ((now - alarm->scheduled_time) / alarm->interval + 1)
+                                     * alarm->interval;
+        alarm->scheduled_time = alarm_deadline(alarm->scheduled_time, alarm->slack);
+        shard = shard_of(alarm->alarm_id);
+        shard_lock(shard);
+        alarm_insert(alarm);
+        shard_unlock(shard);
+    }
+    if (next_id > atomic_load(&next_alarm_id))
+        atomic_store(&next_alarm_id, next_id);
+    output_printf("Recovered %zu alarms from %s (log segments %lld-%lld) in %.3fs\n",
+                  index.count, wal_dir, (long long)snapshot_segment + 1, (long long)segment,
+                  (double)(alarm_now() - start) / NSEC_PER_SEC);
+    wal_free_index(&index);
+
+    wal_open_segment(segment + 1);
+    wal_folded = snapshot_segment;
+    wal_fold_target = segment;
+    status = pthread_create(&thread, NULL, wal_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create log thread");
+    status = pthread_create(&thread, NULL, wal_snapshot_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create snapshot thread");
+}
+
+/*
+ * Reschedule an alarm by id, with the "length" bytes of "message"
+ * as its new message, and a new slack unless "slack" is negative.
+ * Returns 0 if there is no such alarm, and -1, changing nothing, if
+ * it is periodic and "delay" is not positive (as for "Periodic").
+ */
+int change_alarm(int alarm_id, alarm_time_t delay, alarm_time_t slack,
+                 const char *message, size_t length)
+{
+    alarm_t *alarm;
+    alarm_shard_t *shard = shard_of(alarm_id);
+    message_t *interned = message_intern(message, length), *old = NULL;
+
+    shard_lock(shard);
+
+    alarm = store_find(&shard->store, alarm_id);
+    if (alarm != NULL && alarm->periodic && delay <= 0)
+    {
+        shard_unlock(shard);
+        message_release(interned);
+        return -1;
+    }
+    if (alarm != NULL)
+    {
+        alarm->interval = delay;
+        old = alarm->message;
+        alarm->message = interned;
+        if (slack >= 0)
+            alarm->slack = slack;
+        store_reschedule(&shard->store, alarm, alarm_deadline(alarm_now() + delay, alarm->slack));
+        alarm_wake(shard, alarm->scheduled_time);
+        wal_log(WAL_CHANGE, alarm);
+    }
+
+    shard_unlock(shard);
+    message_release(alarm != NULL ? old : interned);
+    return alarm != NULL;
+}
+
+
+/*
+ * Remove an alarm by id. Returns 0 if there is no such alarm.
+ */
+int cancel_alarm(int alarm_id)
+{
+    alarm_t *alarm;
+    alarm_shard_t *shard = shard_of(alarm_id);
+    alarm_display_t *display;
+
+    shard_lock(shard);
+
+    alarm = store_find(&shard->store, alarm_id);
+    if (alarm != NULL)
+    {
+        store_remove(&shard->store, alarm);
+        wal_log(WAL_CANCEL, alarm);
+        alarm_free(alarm);
+    }
+
+    shard_unlock(shard);
+    if (alarm != NULL)
+        return 1;
+
+    /*
+     * A periodic alarm that has already fired lives on a display
+     * list (display_lock() takes in any still in its inbox). One
+     * that is still in the circular buffer is in neither place, and
+     * cannot be cancelled until the consumer has it.
+     */
+    display = display_of(alarm_id);
+    display_lock(display);
+    alarm = index_get(&display->index, alarm_id);
+    if (alarm != NULL)
+    {
+        heap_delete(&display->list, alarm);
+        index_delete(&display->index, alarm_id);
+        wal_log(WAL_CANCEL, alarm);
+        alarm_free(alarm);
+    }
+    display_unlock(display);
+    return alarm != NULL;
+}
+
+/*
+ * An alarm found by "List range": copied out under the shard's
+ * mutex, and printed after it is released.
+ */
+typedef struct range_entry_tag
+{
+    alarm_time_t due;
+    int alarm_id;
+    message_t *message; // a reference the entry holds
+} range_entry_t;
+
+static int range_entry_compare(const void *a, const void *b)
+{
+    const range_entry_t *x = (const range_entry_t *)a, *y = (const range_entry_t *)b;
+
+    if (x->due != y->due)
+        return x->due < y->due ? -1 : 1;
+    return (x->alarm_id > y->alarm_id) - (x->alarm_id < y->alarm_id);
+}
+
+static void range_entry_add(range_entry_t **entries, size_t *count, size_t *capacity,
+                            const alarm_t *alarm)
+{
+    range_entry_t *grown;
+
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        grown = (range_entry_t *)realloc(*entries, *capacity * sizeof(range_entry_t));
+        if (grown == NULL)
+            errno_abort("Allocate range list");
+        *entries = grown;
+    }
+    (*entries)[*count].due = alarm->scheduled_time;
+    (*entries)[*count].alarm_id = alarm->alarm_id;
+    (*entries)[*count].message = message_hold(alarm->message);
+    (*count)++;
+}
+
+/*
+ * Carry out a range command ("op") on every alarm due in [from, to]
+ * whose message starts with the "length" bytes of "prefix": cancel
+ * it, shift it by "by", or list it, in due order, passing each line
+ * to "show". Each shard's mutex is taken once, and the time-range
+ * index finds the k alarms in the window in O(k log n); the prefix
+ * is then matched against each, so an open window with a prefix
+ * costs O(n). A shift never moves an
+ * alarm into the past: one shifted earlier than now is due now (or
+ * stays where it was, if that is earlier still).
+ *
+ * Periodic alarms between displays are on display lists, which are
+ * heaps with no time-range index, so List and Cancel scan each list
+ * once under its lock, in O(size). Like Cancel, they miss an alarm
+ * still in the circular buffer; like Change, Shift does not reach
+ * the display lists at all. Returns the number of alarms matched.
+ */
+long range_alarms(int op, alarm_time_t from, alarm_time_t to, alarm_time_t by,
+                  const char *prefix, size_t length,
+                  void (*show)(void *arg, const char *line, size_t length), void *arg)
+{
+    alarm_shard_t *shard;
+    alarm_display_t *display;
+    alarm_t *alarm, **doomed = NULL, **grown;
+    alarm_time_t when, target, earliest, now = alarm_now();
+    range_entry_t *entries = NULL;
+    size_t count = 0, capacity = 0, doomed_count, doomed_capacity = 0, i;
+    char line[MESSAGE_MAX + 64];
+    long matched = 0;
+    int index, alarm_id, printed, down = op == RANGE_SHIFT && by > 0;
+
+    for (index = 0; index < alarm_shard_count; index++)
+    {
+        shard = &alarm_shards[index];
+        earliest = INT64_MAX;
+        shard_lock(shard);
+        /*
+         * A shift later walks the window from the top down, and
+         * anything else from the bottom up, so an alarm that has
+         * been shifted is never met again.
+         */
+        alarm = down ? range_last(&shard->store, to)
+                     : range_next(&shard->store, from, 0);
+        while (alarm != NULL && alarm->scheduled_time >= from && alarm->scheduled_time <= to)
+        {
+            when = alarm->scheduled_time;
+            alarm_id = alarm->alarm_id;
+            if (alarm->message->length >= length
+                && memcmp(alarm->message->text, prefix, length) == 0)
+            {
+                matched++;
+                if (op == RANGE_CANCEL)
+                {
+                    store_remove(&shard->store, alarm);
+                    wal_log(WAL_CANCEL, alarm);
+                    alarm_free(alarm);
+                }
+                else if (op == RANGE_SHIFT)
+                {
+                    // Not into the past, nor later for one overdue.
+                    target = when + by;
+                    if (target < now)
+                        target = when < now ? when : now;
+                    store_reschedule(&shard->store, alarm, alarm_deadline(target, alarm->slack));
+                    if (alarm->scheduled_time < earliest)
+                        earliest = alarm->scheduled_time;
+                    wal_log(WAL_CHANGE, alarm);
+                }
+                else
+                    range_entry_add(&entries, &count, &capacity, alarm);
+            }
+            alarm = down ? range_prev(&shard->store, when, alarm_id)
+                         : range_next(&shard->store, when, alarm_id);
+        }
+        if (earliest != INT64_MAX)
+            alarm_wake(shard, earliest);
+        shard_unlock(shard);
+    }
+
+    for (index = 0; op != RANGE_SHIFT && index < alarm_display_count; index++)
+    {
+        display = &alarm_displays[index];
+        doomed_count = 0;
+        display_lock(display);
+        for (i = 0; i < display->list.size; i++)
+        {
+            alarm = display->list.node[i];
+            if (alarm->scheduled_time < from || alarm->scheduled_time > to
+                || alarm->message->length < length
+                || memcmp(alarm->message->text, prefix, length) != 0)
+                continue;
+            matched++;
+            if (op == RANGE_LIST)
+            {
+                range_entry_add(&entries, &count, &capacity, alarm);
+                continue;
+            }
+            // Deleting reorders the heap; collect them first.
+            if (doomed_count == doomed_capacity)
+            {
+                doomed_capacity = doomed_capacity ? doomed_capacity * 2 : 64;
+                grown = (alarm_t **)realloc(doomed, doomed_capacity * sizeof(alarm_t *));
+                if (grown == NULL)
+                    errno_abort("Allocate range list");
+                doomed = grown;
+            }
+            doomed[doomed_count++] = alarm;
+        }
+        while (doomed_count > 0)
+        {
+            alarm = doomed[--doomed_count];
+            heap_delete(&display->list, alarm);
+            index_delete(&display->index, alarm->alarm_id);
+            wal_log(WAL_CANCEL, alarm);
+            alarm_free(alarm);
+        }
+        display_unlock(display);
+    }
+    free(doomed);
+
+    // The shards' and lists' alarms are each in order; show them as one.
+    qsort(entries, count, sizeof(range_entry_t), range_entry_compare);
+    now = alarm_now();
+    for (i = 0; i < count; i++)
+    {
+        printed = snprintf(line, sizeof(line), "Alarm(%d) due in %.6fs: %s\n", entries[i].alarm_id,
+                           (double)(entries[i].due - now) / NSEC_PER_SEC, entries[i].message->text);
+        show(arg, line, printed < (int)sizeof(line) ? (size_t)printed : sizeof(line) - 1);
+        message_release(entries[i].message);
+    }
+    free(entries);
+    return matched;
+}
+
+/*
+ * Finish with an alarm whose action has run (or whose firing was
+ * dropped): one-shot alarms are done, and periodic ones move to
+ * their display list, due for display one interval after they were
+ * scheduled to fire.
+ */
+void alarm_retire(alarm_t *alarm)
+{
+    // A period of 0 (say, from an old log) would display forever.
+    if (!alarm->periodic || alarm->interval <= 0)
+    {
+        wal_log(WAL_DONE, alarm);
+        alarm_free(alarm);
+        return;
+    }
+    alarm->scheduled_time += alarm->interval;
+    display_post(alarm);
+}
+
+static void buffer_drop(circular_buffer_t *buffer, alarm_t **alarms, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        alarm_retire(alarms[i]);
+    atomic_fetch_add_explicit(&buffer->dropped, count, memory_order_relaxed);
+}
+
+/*
+ * Hand fired alarms to the consumer, applying the backpressure
+ * policy if the buffer is full.
+ */
+static void buffer_push(circular_buffer_t *buffer, alarm_t **alarms, size_t count)
+{
+    alarm_t *oldest[EXPIRE_BATCH];
+    alarm_time_t start, now;
+    struct timespec deadline;
+    size_t done, taken;
+    int status;
+
+    if (buffer_policy == BUFFER_SPILL && atomic_load(&buffer->spill) != NULL)
+    {
+        // Stay behind what has already spilled.
+        atomic_fetch_add_explicit(&buffer->full, 1, memory_order_relaxed);
+        buffer_spill(buffer, alarms, count);
+        return;
+    }
+    done = buffer_put(buffer, alarms, count);
+    if (done == count)
+        return;
+    atomic_fetch_add_explicit(&buffer->full, 1, memory_order_relaxed);
+
+    switch (buffer_policy)
+    {
+    case BUFFER_DROP_NEWEST:
+        buffer_drop(buffer, alarms + done, count - done);
+        break;
+    case BUFFER_SPILL:
+        buffer_spill(buffer, alarms + done, count - done);
+        break;
+    case BUFFER_DROP_OLDEST:
+        while (done < count)
+        {
+            taken = mpmc_take(buffer, oldest, count - done);
+            if (taken == 0)
+                cpu_relax(); // the oldest slots are still being filled
+            buffer_drop(buffer, oldest, taken);
+            done += buffer_put(buffer, alarms + done, count - done);
+        }
+        break;
+    default:
+        start = alarm_now();
+        alarm_timespec(start + buffer_timeout, &deadline);
+        atomic_fetch_add(&buffer->waiting, 1);
+        while (1)
+        {
+            // Pairs with the fence in buffer_release().
+            atomic_thread_fence(memory_order_seq_cst);
+            done += buffer_put(buffer, alarms + done, count - done);
+            if (done == count)
+                break;
+            if (buffer_timeout == 0)
+                status = sem_wait(&buffer->space);
+            else
+                status = sem_clockwait(&buffer->space, CLOCK_MONOTONIC, &deadline);
+            if (status != 0 && errno == ETIMEDOUT)
+            {
+                done += buffer_put(buffer, alarms + done, count - done);
+                atomic_fetch_add_explicit(&buffer->timeouts, 1, memory_order_relaxed);
+                buffer_drop(buffer, alarms + done, count - done);
+                break;
+            }
+            if (status != 0 && errno != EINTR)
+                errno_abort("Wait for circular buffer space");
+        }
+        atomic_fetch_sub(&buffer->waiting, 1);
+        now = alarm_now();
+        atomic_fetch_add_explicit(&buffer->stalled, now - start, memory_order_relaxed);
+        break;
+    }
+}
+
+/*
+ * Expire everything in the shard that is due at "now", handing it
+ * to the consumer EXPIRE_BATCH alarms at a time. A full buffer is
+ * dealt with by the backpressure policy. The caller holds the
+ * shard's mutex; it is dropped while each batch is pushed, so that
+ * when "-r block" waits for room it stalls only this thread, never
+ * a producer inserting into the shard. The batch is out of the
+ * store by then, so Change and Cancel miss it, as they would once
+ * it was in the buffer. Only the shard's own alarm thread expires
+ * it, so the buffer's producers are unchanged.
+ */
+static void shard_expire(alarm_shard_t *shard, alarm_time_t now)
+{
+    alarm_t *batch[EXPIRE_BATCH];
+    size_t count;
+
+    do
+    {
+        for (count = 0; count < EXPIRE_BATCH; count++)
+        {
+            batch[count] = store_expire(&shard->store, now);
+            if (batch[count] == NULL)
+                break;
+            batch[count]->fired_time = now;
+        }
+        shard->fired += count;
+        if (count > 0)
+        {
+            shard_unlock(shard);
+            buffer_push(&alarm_buffer, batch, count);
+            shard_lock(shard);
+        }
+    } while (count == EXPIRE_BATCH);
+}
+
+/*
+ * The alarm thread's start routine. There is one alarm thread per
+ * shard, passed in "arg".
+ */
+void *alarm_thread(void *arg)
+{
+    alarm_shard_t *shard = (alarm_shard_t *)arg;
+    struct timespec cond_time;
+    alarm_time_t now, deadline;
+    alarm_time_t tuned = 0; // deadline whose wait spin_tune() has counted
+    long fired;
+    int status, timed_out = 0;
+
+    /*
+     * Loop forever, processing commands. The alarm thread will
+     * be disintegrated when the process exits. Lock the mutex
+     * at the start -- it will be unlocked during condition
+     * waits, so the main thread can insert alarms.
+     */
+    shard_lock(shard);
+    while (1)
+    {
+        /*
+         * If the alarm store is empty, wait until an alarm is
+         * added. Setting current_alarm to 0 informs the insert
+         * routine that the thread is not busy.
+         */
+        shard->current_alarm = 0;
+        while (shard->store.count == 0)
+        {
+            lock_stats_release(&shard->lock_stats);
+            status = pthread_cond_wait(&shard->cond, &shard->mutex);
+            if (status != 0)
+                err_abort(status, "Wait on cond");
+            lock_stats_acquire(&shard->lock_stats, 0);
+            shard->wakeups++;
+            if (shard->store.count == 0)
+                shard->spurious++;
+        }
+        /*
+         * Fire everything that is due in one pass; alarms whose
+         * slack gave them the same deadline go together.
+         */
+        fired = shard->fired;
+        now = alarm_now();
+        shard_expire(shard, now);
+        if (shard->fired == fired && timed_out)
+            shard->idle_wakeups++;
+        timed_out = 0;
+        if (shard->store.count == 0)
+            continue;
+
+        /*
+         * Nothing more is due yet. Wait for the earliest deadline the
+         * store can promise, or until alarm_insert() signals an
+         * earlier one. Either way, go round again and ask the
+         * store what is due; the alarm we were waiting for stays
+         * in the store, so there is nothing to requeue. Within the
+         * spin window of the deadline, spin to it instead; further
+         * off, block until the window opens.
+         */
+        deadline = shard->store.backend->next_deadline(&shard->store);
+        shard->current_alarm = deadline;
+        shard->wait_target = deadline - spin_window(shard);
+        if (shard->wait_target <= now)
+        {
+            if (deadline != tuned)
+                spin_skip(shard);
+            shard_spin(shard, deadline);
+            continue;
+        }
+        alarm_timespec(shard->wait_target, &cond_time);
+#ifdef DEBUG
+        printf("[waiting: %lld(%lld)]\n", (long long)deadline,
+               (long long)(deadline - now));
+#endif
+        while (shard->current_alarm == deadline)
+        {
+            lock_stats_release(&shard->lock_stats);
+            status = pthread_cond_timedwait(
+                &shard->cond, &shard->mutex, &cond_time);
+            lock_stats_acquire(&shard->lock_stats, 0);
+            shard->wakeups++;
+            if (status == ETIMEDOUT)
+            {
+                shard->timeouts++;
+                spin_tune(shard, alarm_now() - shard->wait_target);
+                tuned = deadline;
+                timed_out = shard->wait_target == deadline;
+                break;
+            }
+            if (status != 0)
+                err_abort(status, "Cond timedwait");
+            if (shard->current_alarm == deadline)
+                shard->spurious++;
+        }
+    }
+}
+
+/*
+ * The "epoll" engine's timerfd handler. Expire everything that is
+ * due, hand it to the consumer, and re-arm the timerfd for the new
+ * earliest deadline. Inserts and changes only ever move the timer
+ * earlier (see alarm_wake()), so a later alarm never has to leave
+ * the store while an earlier one is waited for.
+ */
+static void timer_handler(event_source_t *source, uint32_t events)
+{
+    alarm_shard_t *shard = (alarm_shard_t *)source->arg;
+    uint64_t expirations;
+    alarm_time_t now;
+    int fired = 1;
+
+    if (read(source->fd, &expirations, sizeof(expirations)) < 0)
+    {
+        if (errno != EAGAIN)
+            errno_abort("Read timerfd");
+        fired = 0;              // re-armed since epoll saw it
+    }
+
+    shard_lock(shard);
+    now = alarm_now();
+    if (shard->current_alarm != 0)
+    {
+        if (fired)
+            spin_tune(shard, now - shard->wait_target);
+        // Woken the spin window early: spin the rest of the way.
+        if (shard->current_alarm > now)
+            shard_spin(shard, shard->current_alarm);
+    }
+    shard_expire(shard, alarm_now());
+
+    shard->current_alarm = 0;
+    if (shard->store.count > 0)
+    {
+        shard->current_alarm = shard->store.backend->next_deadline(&shard->store);
+        timer_arm(shard, shard->current_alarm);
+    }
+    shard_unlock(shard);
+}
+
+/*
+ * The "epoll" engine's alarm thread: wait for any file descriptor
+ * the shard watches, and run its handler.
+ */
+void *alarm_epoll_thread(void *arg)
+{
+    alarm_shard_t *shard = (alarm_shard_t *)arg;
+    struct epoll_event events[EPOLL_EVENTS];
+    event_source_t *source;
+    int count, i;
+
+    while (1)
+    {
+        count = epoll_wait(shard->epoll_fd, events, EPOLL_EVENTS, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Wait on epoll");
+        }
+        for (i = 0; i < count; i++)
+        {
+            source = (event_source_t *)events[i].data.ptr;
+            source->handler(source, events[i].events);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The default action: print the firing, and tell the socket client
+ * that created the alarm, if any. Each firing reports how late the
+ * alarm thread expired it, in microseconds.
+ */
+static void alarm_print(alarm_t *alarm)
+{
+    output_printf("(%gs) %s [late %lldus]\n",
+                  (double)alarm->interval / NSEC_PER_SEC, alarm->message->text,
+                  (long long)(alarm->fired_time - alarm->scheduled_time) / 1000);
+    if (alarm->owner != 0)
+        server_notify(alarm);
+}
+
+/*
+ * Append a batch of fired alarms to the next worker's deque, and
+ * post a unit of work for each. Called by the consumer only.
+ */
+void executor_submit(alarm_t **alarms, size_t count)
+{
+    static int next;
+    executor_worker_t *worker = &executor_workers[next];
+    alarm_t **deque;
+    size_t i, capacity;
+    int status;
+
+    next = (next + 1) % executor_count;
+    status = pthread_mutex_lock(&worker->mutex);
+    if (status != 0)
+        err_abort(status, "Lock executor deque");
+    if (worker->count + count > worker->capacity)
+    {
+        // Unwrap into a ring twice the size (or more).
+        capacity = worker->capacity * 2;
+        while (worker->count + count > capacity)
+            capacity *= 2;
+        deque = (alarm_t **)malloc(capacity * sizeof(alarm_t *));
+        if (deque == NULL)
+            errno_abort("Grow executor deque");
+        for (i = 0; i < worker->count; i++)
+            deque[i] = worker->deque[(worker->first + i) & (worker->capacity - 1)];
+        free(worker->deque);
+        worker->deque = deque;
+        worker->first = 0;
+        worker->capacity = capacity;
+    }
+    for (i = 0; i < count; i++)
+        worker->deque[(worker->first + worker->count++) & (worker->capacity - 1)] = alarms[i];
+    if (worker->count > worker->max_depth)
+        worker->max_depth = worker->count;
+    status = pthread_mutex_unlock(&worker->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock executor deque");
+    for (i = 0; i < count; i++)
+        if (sem_post(&executor_work) != 0)
+            errno_abort("Post executor work");
+}
+
+/*
+ * Take one alarm from the front of the worker's own deque, or else
+ * steal one from the back of another's. The caller holds a unit of
+ * "work", so some deque has an alarm for it.
+ */
+static alarm_t *executor_take(executor_worker_t *self)
+{
+    executor_worker_t *victim;
+    alarm_t *alarm = NULL;
+    int status, i;
+
+    while (1)
+    {
+        for (i = 0; i < executor_count; i++)
+        {
+            victim = &executor_workers[(self - executor_workers + i) % executor_count];
+            status = pthread_mutex_lock(&victim->mutex);
+            if (status != 0)
+                err_abort(status, "Lock executor deque");
+            if (victim->count > 0)
+            {
+                if (victim == self)
+                {
+                    alarm = victim->deque[victim->first];
+                    victim->first = (victim->first + 1) & (victim->capacity - 1);
+                }
+                else
+                    alarm = victim->deque[(victim->first + victim->count - 1)
+                                          & (victim->capacity - 1)];
+                victim->count--;
+            }
+            status = pthread_mutex_unlock(&victim->mutex);
+            if (status != 0)
+                err_abort(status, "Unlock executor deque");
+            if (alarm != NULL)
+            {
+                if (victim != self)
+                    atomic_fetch_add_explicit(&self->steals, 1, memory_order_relaxed);
+                return alarm;
+            }
+        }
+        sched_yield();
+    }
+}
+
+/*
+ * An executor worker's start routine. Run each alarm's action, then
+ * retire the alarm. Output is queued every CONSUMER_BATCH alarms,
+ * and whenever the worker runs out of work.
+ */
+void *executor_thread(void *arg)
+{
+    executor_worker_t *self = (executor_worker_t *)arg;
+    alarm_t *alarm;
+    int unflushed = 0;
+
+    while (1)
+    {
+        if (sem_trywait(&executor_work) != 0)
+        {
+            if (errno != EAGAIN)
+                errno_abort("Take executor work");
+            output_flush();
+            unflushed = 0;
+            while (sem_wait(&executor_work) != 0)
+                if (errno != EINTR)
+                    errno_abort("Wait for executor work");
+        }
+        else if (++unflushed == CONSUMER_BATCH)
+        {
+            output_flush();
+            unflushed = 0;
+        }
+        alarm = executor_take(self);
+        alarm->action(alarm);
+        atomic_fetch_add_explicit(&self->executed, 1, memory_order_relaxed);
+        alarm_retire(alarm);
+    }
+    return NULL;
+}
+
+/*
+ * Percentiles of a histogram, taken under the lock that protects
+ * it so they can be printed after it is released.
+ */
+typedef struct histogram_summary_tag
+{
+    long count;
+    alarm_time_t p50, p90, p99, p999, max;
+} histogram_summary_t;
+
+static void histogram_summarize(const histogram_t *histogram, histogram_summary_t *summary)
+{
+    summary->count = histogram->total;
+    summary->p50 = histogram_percentile(histogram, 0.5);
+    summary->p90 = histogram_percentile(histogram, 0.9);
+    summary->p99 = histogram_percentile(histogram, 0.99);
+    summary->p999 = histogram_percentile(histogram, 0.999);
+    summary->max = histogram->max;
+}
+
+static void stats_histogram(const char *name, const histogram_summary_t *summary)
+{
+    output_printf("stat %s.count %ld\n", name, summary->count);
+    if (summary->count == 0)
+        return;
+    output_printf("stat %s.p50 %lld\nstat %s.p90 %lld\nstat %s.p99 %lld\n"
+                  "stat %s.p999 %lld\nstat %s.max %lld\n",
+                  name, (long long)summary->p50, name, (long long)summary->p90,
+                  name, (long long)summary->p99, name, (long long)summary->p999,
+                  name, (long long)summary->max);
+}
+
+/*
+ * Print every counter, one "stat <name> <value>" line each, times
+ * in nanoseconds, and flush. Each lock is held only to copy what
+ * it protects. Lock times are only there with "-s".
+ */
+void stats_dump(void)
+{
+    alarm_shard_t *shard;
+    alarm_display_t *display;
+    executor_worker_t *worker;
+    histogram_summary_t wait, hold, lateness, wakeup;
+    size_t depth, max_depth;
+    long pending = 0, count, wakeups, timeouts, spurious, idle, requeues, fired, spins;
+    alarm_time_t spin_time, window;
+    long dropped, writes;
+    int status, i, queued;
+    char name[64];
+
+    for (i = 0; i < alarm_shard_count; i++)
+    {
+        shard = &alarm_shards[i];
+        shard_lock(shard);
+        count = shard->store.count;
+        wakeups = shard->wakeups;
+        timeouts = shard->timeouts;
+        spurious = shard->spurious;
+        idle = shard->idle_wakeups;
+        requeues = shard->requeues;
+        fired = shard->fired;
+        spins = shard->spins;
+        spin_time = shard->spin_time;
+        window = spin_window(shard);
+        histogram_summarize(&shard->wakeup_late, &wakeup);
+        histogram_summarize(&shard->lock_stats.wait, &wait);
+        histogram_summarize(&shard->lock_stats.hold, &hold);
+        shard_unlock(shard);
+
+        pending += count;
+        output_printf("stat shard.%d.pending %ld\n", i, count);
+        output_printf("stat shard.%d.fired %ld\n", i, fired);
+        output_printf("stat shard.%d.wakeups %ld\n", i, wakeups);
+        output_printf("stat shard.%d.timeouts %ld\n", i, timeouts);
+        output_printf("stat shard.%d.spurious %ld\n", i, spurious);
+        output_printf("stat shard.%d.idle_wakeups %ld\n", i, idle);
+        output_printf("stat shard.%d.requeues %ld\n", i, requeues);
+        output_printf("stat shard.%d.spins %ld\nstat shard.%d.spin_ns %lld\n"
+                      "stat shard.%d.spin_window %lld\n",
+                      i, spins, i, (long long)spin_time, i, (long long)window);
+        snprintf(name, sizeof(name), "shard.%d.wakeup_late", i);
+        stats_histogram(name, &wakeup);
+        if (stats_enabled)
+        {
+            snprintf(name, sizeof(name), "shard.%d.lock_wait", i);
+            stats_histogram(name, &wait);
+            snprintf(name, sizeof(name), "shard.%d.lock_hold", i);
+            stats_histogram(name, &hold);
+        }
+    }
+
+    for (i = 0; i < alarm_display_count; i++)
+    {
+        display = &alarm_displays[i];
+        display_lock(display);
+        count = display->list.size;
+        histogram_summarize(&display->lock_stats.wait, &wait);
+        histogram_summarize(&display->lock_stats.hold, &hold);
+        display_unlock(display);
+
+        pending += count;
+        output_printf("stat display.%d.pending %ld\n", i, count);
+        if (stats_enabled)
+        {
+            snprintf(name, sizeof(name), "display.%d.lock_wait", i);
+            stats_histogram(name, &wait);
+            snprintf(name, sizeof(name), "display.%d.lock_hold", i);
+            stats_histogram(name, &hold);
+        }
+    }
+    output_printf("stat pending %ld\n", pending);
+
+    status = pthread_mutex_lock(&lateness_mutex);
+    if (status != 0)
+        err_abort(status, "Lock lateness mutex");
+    histogram_summarize(&lateness_histogram, &lateness);
+    status = pthread_mutex_unlock(&lateness_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock lateness mutex");
+    stats_histogram("lateness", &lateness);
+
+    output_printf("stat pool.size %ld\nstat pool.slabs %ld\n"
+                  "stat pool.in_use %ld\nstat pool.high_water %ld\n",
+                  atomic_load(&pool_size), atomic_load(&pool_slabs),
+                  atomic_load(&pool_in_use), atomic_load(&pool_high_water));
+    output_printf("stat message.count %ld\nstat message.bytes %ld\n"
+                  "stat message.interns %ld\nstat message.shared %ld\n",
+                  atomic_load(&message_count), atomic_load(&message_bytes),
+                  atomic_load(&message_interns), atomic_load(&message_shared));
+
+    status = pthread_mutex_lock(&output_mutex);
+    if (status != 0)
+        err_abort(status, "Lock output mutex");
+    queued = output_queued;
+    dropped = output_dropped;
+    writes = output_writes;
+    status = pthread_mutex_unlock(&output_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock output mutex");
+    output_printf("stat output.queued %d\nstat output.dropped %ld\nstat output.writes %ld\n",
+                  queued, dropped, writes);
+    output_printf("stat buffer.full %ld\nstat buffer.stalled_ns %ld\nstat buffer.timeouts %ld\n"
+                  "stat buffer.dropped %ld\nstat buffer.spilled %ld\n",
+                  atomic_load(&alarm_buffer.full), atomic_load(&alarm_buffer.stalled),
+                  atomic_load(&alarm_buffer.timeouts), atomic_load(&alarm_buffer.dropped),
+                  atomic_load(&alarm_buffer.spilled));
+    output_printf("stat executor.workers %d\n", executor_count);
+    for (i = 0; i < executor_count; i++)
+    {
+        worker = &executor_workers[i];
+        status = pthread_mutex_lock(&worker->mutex);
+        if (status != 0)
+            err_abort(status, "Lock executor deque");
+        depth = worker->count;
+        max_depth = worker->max_depth;
+        status = pthread_mutex_unlock(&worker->mutex);
+        if (status != 0)
+            err_abort(status, "Unlock executor deque");
+        output_printf("stat executor.%d.executed %ld\nstat executor.%d.steals %ld\n"
+                      "stat executor.%d.depth %zu\nstat executor.%d.max_depth %zu\n",
+                      i, atomic_load(&worker->executed), i, atomic_load(&worker->steals),
+                      i, depth, i, max_depth);
+    }
+    output_printf("stat server.clients %ld\nstat server.requests %ld\n"
+                  "stat server.notified %ld\nstat server.dropped %ld\n",
+                  atomic_load(&server_connected), atomic_load(&server_requests),
+                  atomic_load(&server_notified), atomic_load(&server_dropped));
+    output_flush();
+}
+
+/*
+ * Make, but do not insert, an alarm from a "<delay> <message>" or
+ * "Periodic" request, to run "action" when it fires. Its firings go
+ * to server client "owner" (0 for none). The caller sets its
+ * scheduled_time from now, its interval and its slack.
+ */
+static alarm_t *make_alarm(const alarm_request_t *request, int64_t owner,
+                           void (*action)(alarm_t *alarm))
+{
+    alarm_t *alarm;
+
+    alarm = alarm_alloc();
+    alarm->owner = owner;
+    alarm->action = action;
+    alarm->alarm_id = atomic_fetch_add(&next_alarm_id, 1);
+    alarm->interval = request->delay;
+    alarm->periodic = request->periodic;
+    alarm->slack = request->slack >= 0 ? request->slack : alarm_slack;
+    alarm->message = message_intern(request->message, request->message_length);
+    return alarm;
+}
+
+/*
+ * Create an alarm from a "<delay> <message>" or "Periodic" request,
+ * to run "action" when it fires, and return its id. Its firings go
+ * to server client "owner" (0 for none).
+ */
+int create_alarm(const alarm_request_t *request, int64_t owner,
+                 void (*action)(alarm_t *alarm))
+{
+    alarm_shard_t *shard;
+    alarm_t *alarm;
+    int alarm_id;
+
+    alarm = make_alarm(request, owner, action);
+    shard = shard_of(alarm->alarm_id);
+    shard_lock(shard);
+    alarm->scheduled_time = alarm_deadline(alarm_now() + alarm->interval, alarm->slack);
+    /*
+     * Insert the new alarm into the alarm store, which
+     * keeps it ordered by expiration time.
+     */
+    alarm_insert(alarm);
+    wal_log(WAL_INSERT, alarm);
+    alarm_id = alarm->alarm_id;
+    shard_unlock(shard);
+    return alarm_id;
+}
+
+/*
+ * Carry out a create, change or cancel command. Returns the id of
+ * the alarm it created, changed or cancelled, 0 if there was no
+ * such alarm, or -1 if a periodic alarm was given a delay that is
+ * not positive. A new alarm's firings go to server client "owner"
+ * (0 for none).
+ */
+int execute_request(const alarm_request_t *request, int64_t owner)
+{
+    int alarm_id = 0, changed;
+
+    switch (request->type)
+    {
+    case REQUEST_CANCEL:
+        if (cancel_alarm(request->alarm_id))
+            alarm_id = request->alarm_id;
+        break;
+    case REQUEST_CHANGE:
+        changed = change_alarm(request->alarm_id, request->delay, request->slack,
+                               request->message, request->message_length);
+        alarm_id = changed > 0 ? request->alarm_id : changed;
+        break;
+    case REQUEST_ALARM:
+        alarm_id = create_alarm(request, owner, alarm_print);
+        break;
+    default:
+        break;
+    }
+    return alarm_id;
+}
+
+/*
+ * Carry out a range command, its window being relative to now,
+ * passing each line "List range" shows to "show". Returns the
+ * number of alarms it matched.
+ */
+long execute_range(const alarm_request_t *request,
+                   void (*show)(void *arg, const char *line, size_t length), void *arg)
+{
+    alarm_time_t now = alarm_now();
+
+    return range_alarms(request->range,
+                        request->from == RANGE_OPEN ? INT64_MIN : now + request->from,
+                        request->to == RANGE_OPEN ? INT64_MAX : now + request->to,
+                        request->delay, request->message, request->message_length,
+                        show, arg);
+}
+
+/*
+ * Show a listed alarm on stdout, through the writer.
+ */
+static void range_output(void *arg, const char *line, size_t length)
+{
+    output_printf("%.*s", (int)length, line);
+}
+
+/*
+ * Carry out one interactive command.
+ */
+void process_alarm_request(const alarm_request_t *request)
+{
+    long count;
+    int alarm_id;
+
+    switch (request->type)
+    {
+    case REQUEST_NONE:
+        break;
+    case REQUEST_BAD:
+        fprintf(stderr, "Bad command\n");
+        break;
+    case REQUEST_POOL:
+        output_printf("Pool: %ld alarms in %ld slabs, %ld in use, high-water %ld\n",
+                      atomic_load(&pool_size), atomic_load(&pool_slabs),
+                      atomic_load(&pool_in_use), atomic_load(&pool_high_water));
+        break;
+    case REQUEST_STATS:
+        stats_dump();
+        break;
+    case REQUEST_SUBSCRIBE:
+        fprintf(stderr, "Subscribe is for socket clients\n");
+        break;
+    case REQUEST_RANGE:
+        count = execute_range(request, range_output, NULL);
+        output_printf("%s %ld alarms\n",
+                      request->range == RANGE_CANCEL ? "Cancelled"
+                      : request->range == RANGE_SHIFT ? "Shifted" : "Listed", count);
+        break;
+    case REQUEST_ALARM:
+        output_printf("Alarm(%d) inserted\n", execute_request(request, 0));
+        break;
+    default:
+        alarm_id = execute_request(request, 0);
+        if (alarm_id == 0)
+            fprintf(stderr, "No alarm %d\n", request->alarm_id);
+        else if (alarm_id < 0)
+            fprintf(stderr, "Periodic alarm %d needs a positive delay\n", request->alarm_id);
+        break;
+    }
+}
+
+/*
+ * Bulk ingestion ("-f"). New alarms are collected per shard and
+ * committed INGEST_BATCH at a time under a single acquisition of
+ * the shard's mutex, waking its alarm thread at most once. A
+ * Change or Cancel first commits its shard's batch, so it sees
+ * every alarm created before it. Alarms are numbered in file order.
+ */
+#define INGEST_BATCH 4096  // alarms per shard per lock acquisition
+#define INGEST_READ 65536  // bytes per read
+
+typedef struct ingest_batch_tag
+{
+    alarm_t *alarm[INGEST_BATCH];
+    int count;
+} ingest_batch_t;
+
+static void ingest_commit(int index, ingest_batch_t *batch)
+{
+    alarm_shard_t *shard = &alarm_shards[index];
+    alarm_time_t earliest;
+    int i;
+
+    if (batch->count == 0)
+        return;
+    shard_lock(shard);
+    earliest = batch->alarm[0]->scheduled_time;
+    for (i = 0; i < batch->count; i++)
+    {
+        store_add(&shard->store, batch->alarm[i]);
+        if (batch->alarm[i]->scheduled_time < earliest)
+            earliest = batch->alarm[i]->scheduled_time;
+    }
+    alarm_wake(shard, earliest);
+    shard_unlock(shard);
+    batch->count = 0;
+}
+
+/*
+ * Read commands from a file ("-" for stdin) until end of file.
+ */
+void ingest_file(const char *path)
+{
+    ingest_batch_t *batches;
+    alarm_request_t request;
+    alarm_t *alarm;
+    char *buffer, *line, *end, *newline;
+    size_t held = 0;
+    ssize_t got;
+    long lineno = 0, created = 0, changed = 0, cancelled = 0, bad = 0;
+    alarm_time_t start = alarm_now(), now;
+    int fd, index, done = 0;
+
+    fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0)
+        errno_abort("Open command file");
+    batches = (ingest_batch_t *)calloc(alarm_shard_count, sizeof(ingest_batch_t));
+    buffer = (char *)malloc(INGEST_READ + 1);
+    if (batches == NULL || buffer == NULL)
+        errno_abort("Allocate ingest buffers");
+
+    while (!done)
+    {
+        got = read(fd, buffer + held, INGEST_READ - held);
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Read command file");
+        }
+        if (got == 0)
+        {
+            // A last line without a newline.
+            done = 1;
+            if (held == 0)
+                break;
+            buffer[held++] = '\n';
+        }
+        end = buffer + held + got;
+        now = alarm_now();
+        for (line = buffer;
+             (newline = memchr(line, '\n', end - line)) != NULL;
+             line = newline + 1)
+        {
+            lineno++;
+            switch (parse_request(line, newline, &request))
+            {
+            case REQUEST_NONE:
+                break;
+            case REQUEST_ALARM:
+                alarm = make_alarm(&request, 0, alarm_print);
+                alarm->scheduled_time = alarm_deadline(now + alarm->interval, alarm->slack);
+                wal_log(WAL_INSERT, alarm);
+                index = shard_of(alarm->alarm_id) - alarm_shards;
+                batches[index].alarm[batches[index].count++] = alarm;
+                if (batches[index].count == INGEST_BATCH)
+                    ingest_commit(index, &batches[index]);
+                created++;
+                break;
+            case REQUEST_CHANGE:
+            case REQUEST_CANCEL:
+                index = shard_of(request.alarm_id) - alarm_shards;
+                ingest_commit(index, &batches[index]);
+                process_alarm_request(&request);
+                if (request.type == REQUEST_CHANGE)
+                    changed++;
+                else
+                    cancelled++;
+                break;
+            case REQUEST_RANGE:
+                for (index = 0; index < alarm_shard_count; index++)
+                    ingest_commit(index, &batches[index]);
+                process_alarm_request(&request);
+                break;
+            default:
+                fprintf(stderr, "%s:%ld: bad command\n", path, lineno);
+                bad++;
+                break;
+            }
+        }
+        // One group commit for everything in the block.
+        wal_sync();
+        held = end - line;
+        if (held == INGEST_READ)
+        {
+            fprintf(stderr, "%s:%ld: line too long\n", path, lineno + 1);
+            bad++;
+            held = 0;
+        }
+        memmove(buffer, line, held);
+    }
+    for (index = 0; index < alarm_shard_count; index++)
+        ingest_commit(index, &batches[index]);
+    if (fd != STDIN_FILENO)
+        close(fd);
+    free(buffer);
+    free(batches);
+    output_printf("Ingested %ld alarms, %ld changes, %ld cancels, %ld bad lines in %.3fs\n",
+                  created, changed, cancelled, bad,
+                  (double)(alarm_now() - start) / NSEC_PER_SEC);
+}
+
+/*
+ * The socket server ("-u path"): a Unix-domain stream socket that
+ * takes the same commands as stdin, one per line, from any number
+ * of clients, served by one thread on its own epoll loop. A client
+ * may pipeline as many commands as it likes; each gets one reply
+ * line, in order:
+ *   OK <id>              the alarm it created, changed or cancelled
+ *                        (0 for Pool, Stats and Subscribe)
+ *   ERR no alarm <id>
+ *   ERR bad command
+ * "Pool" sends its counter line, and "List range" a line per alarm,
+ * before the reply; "Stats" prints on stdout only.
+ * A client that sends "Subscribe" is then also sent
+ *   FIRED <id> <message>
+ * each time one of the alarms it created fires. Replies to a batch
+ * of commands are sent only after the batch is durable, so one log
+ * sync covers them all.
+ */
+#define SERVER_IN 65536            // unparsed command bytes per client
+#define SERVER_OUT_MAX (1 << 20)   // unsent bytes at which a client stops being read
+#define SERVER_NOTES 4096          // firings queued for the server thread
+
+typedef struct server_client_tag
+{
+    event_source_t source;
+    uint32_t serial;   // tells this client from an earlier one on the same fd
+    int subscribed;
+    int eof;           // client has sent its last command
+    uint32_t events;   // what the epoll loop watches for
+    char *out;         // unsent replies, out[out_start, out_start + out_length)
+    size_t out_start, out_length, out_size;
+    size_t in_length;
+    char in[SERVER_IN];
+} server_client_t;
+
+typedef struct server_note_tag
+{
+    int64_t owner;
+    int alarm_id;
+    message_t *message; // a reference the note holds
+} server_note_t;
+
+const char *server_path;              // "-u": NULL for no server
+int server_epoll_fd = -1;
+int server_event_fd = -1;             // written when the note queue becomes non-empty
+server_client_t **server_clients;     // by fd; server thread only
+int server_client_slots;
+uint32_t server_serial;               // server thread only
+pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+server_note_t server_notes[SERVER_NOTES]; // ring; server_mutex
+size_t server_note_first, server_note_count;
+
+/*
+ * Queue a firing for the client that created the alarm, if it is
+ * still connected and subscribed. Called by the executor and the
+ * display threads for alarms with an owner; never blocks on the
+ * client. A full queue drops the firing.
+ */
+void server_notify(const alarm_t *alarm)
+{
+    server_note_t *note;
+    uint64_t one = 1;
+    int status, wake = 0;
+
+    status = pthread_mutex_lock(&server_mutex);
+    if (status != 0)
+        err_abort(status, "Lock server mutex");
+    if (server_note_count == SERVER_NOTES)
+        atomic_fetch_add(&server_dropped, 1);
+    else
+    {
+        note = &server_notes[(server_note_first + server_note_count++) % SERVER_NOTES];
+        note->owner = alarm->owner;
+        note->alarm_id = alarm->alarm_id;
+        note->message = message_hold(alarm->message);
+        wake = server_note_count == 1;
+    }
+    status = pthread_mutex_unlock(&server_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock server mutex");
+    if (wake && write(server_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        errno_abort("Wake server");
+}
+
+static void server_watch(server_client_t *client, uint32_t events)
+{
+    struct epoll_event event;
+
+    if (events == client->events)
+        return;
+    event.events = events;
+    event.data.ptr = &client->source;
+    if (epoll_ctl(server_epoll_fd, EPOLL_CTL_MOD, client->source.fd, &event) < 0)
+        errno_abort("Modify server epoll");
+    client->events = events;
+}
+
+static void server_close(server_client_t *client)
+{
+    server_clients[client->source.fd] = NULL;
+    close(client->source.fd); // also removes it from the epoll set
+    free(client->out);
+    free(client);
+    atomic_fetch_sub(&server_connected, 1);
+}
+
+/*
+ * Append text to a client's unsent output, growing the buffer as
+ * needed.
+ */
+static void server_append(server_client_t *client, const char *text, size_t length)
+{
+    if (client->out_start > 0)
+    {
+        memmove(client->out, client->out + client->out_start, client->out_length);
+        client->out_start = 0;
+    }
+    if (client->out_length + length > client->out_size)
+    {
+        client->out_size = client->out_size ? client->out_size * 2 : 4096;
+        while (client->out_length + length > client->out_size)
+            client->out_size *= 2;
+        client->out = (char *)realloc(client->out, client->out_size);
+        if (client->out == NULL)
+            errno_abort("Allocate client output");
+    }
+    memcpy(client->out + client->out_length, text, length);
+    client->out_length += length;
+}
+
+/*
+ * Send what the socket will take, and watch for whatever the
+ * client is waiting on: writability while output is left, and
+ * commands unless it has fallen too far behind. A client that has
+ * sent its last command is closed once it has had every reply.
+ * Returns 0 if the client was closed.
+ */
+static int server_send(server_client_t *client)
+{
+    ssize_t sent;
+
+    while (client->out_length > 0)
+    {
+        sent = send(client->source.fd, client->out + client->out_start,
+                    client->out_length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            server_close(client);
+            return 0;
+        }
+        client->out_start += sent;
+        client->out_length -= sent;
+    }
+    if (client->out_length == 0)
+    {
+        client->out_start = 0;
+        if (client->eof)
+        {
+            server_close(client);
+            return 0;
+        }
+    }
+    server_watch(client, (client->out_length > 0 ? EPOLLOUT : 0)
+                             | (client->out_length < SERVER_OUT_MAX && !client->eof ? EPOLLIN : 0));
+    return 1;
+}
+
+/*
+ * Append a line of "List range" output to a client's reply.
+ */
+static void server_range_line(void *arg, const char *line, size_t length)
+{
+    server_append((server_client_t *)arg, line, length);
+}
+
+/*
+ * Carry out one command line from a client and append its reply.
+ */
+static void server_request(server_client_t *client, const char *line, const char *end)
+{
+    alarm_request_t request;
+    char reply[128];
+    int length, alarm_id;
+
+    atomic_fetch_add(&server_requests, 1);
+    switch (parse_request(line, end, &request))
+    {
+    case REQUEST_NONE:
+        return;
+    case REQUEST_BAD:
+        length = snprintf(reply, sizeof(reply), "ERR bad command\n");
+        break;
+    case REQUEST_POOL:
+        length = snprintf(reply, sizeof(reply),
+                          "Pool: %ld alarms in %ld slabs, %ld in use, high-water %ld\n",
+                          atomic_load(&pool_size), atomic_load(&pool_slabs),
+                          atomic_load(&pool_in_use), atomic_load(&pool_high_water));
+        server_append(client, reply, length);
+        length = snprintf(reply, sizeof(reply), "OK 0\n");
+        break;
+    case REQUEST_STATS:
+        stats_dump();
+        length = snprintf(reply, sizeof(reply), "OK 0\n");
+        break;
+    case REQUEST_SUBSCRIBE:
+        client->subscribed = 1;
+        length = snprintf(reply, sizeof(reply), "OK 0\n");
+        break;
+    case REQUEST_RANGE:
+        // "List range" sends a line per alarm before the count.
+        length = snprintf(reply, sizeof(reply), "OK %ld\n",
+                          execute_range(&request, server_range_line, client));
+        break;
+    default:
+        alarm_id = execute_request(
+            &request, (int64_t)((uint64_t)client->serial << 32 | (uint32_t)client->source.fd));
+        if (alarm_id == 0)
+            length = snprintf(reply, sizeof(reply), "ERR no alarm %d\n", request.alarm_id);
+        else if (alarm_id < 0)
+            length = snprintf(reply, sizeof(reply), "ERR bad delay for periodic alarm %d\n",
+                              request.alarm_id);
+        else
+            length = snprintf(reply, sizeof(reply), "OK %d\n", alarm_id);
+        break;
+    }
+    server_append(client, reply, length);
+}
+
+/*
+ * A client's socket is readable or writable. Read and carry out
+ * every whole command that has arrived, make them durable, then
+ * send the replies.
+ */
+static void server_client_handler(event_source_t *source, uint32_t events)
+{
+    server_client_t *client = (server_client_t *)source->arg;
+    char *line, *newline, *end;
+    ssize_t count;
+    int closed = 0;
+
+    if (events & EPOLLIN)
+    {
+        while (client->out_length < SERVER_OUT_MAX && !client->eof)
+        {
+            count = read(source->fd, client->in + client->in_length,
+                         SERVER_IN - client->in_length);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    closed = 1;
+                break;
+            }
+            if (count == 0)
+            {
+                client->eof = 1;
+                break;
+            }
+            client->in_length += count;
+            line = client->in;
+            end = client->in + client->in_length;
+            while ((newline = (char *)memchr(line, '\n', end - line)) != NULL)
+            {
+                server_request(client, line, newline);
+                line = newline + 1;
+            }
+            client->in_length = end - line;
+            if (client->in_length == SERVER_IN)
+            {
+                // No command is this long; throw it away.
+                server_append(client, "ERR bad command\n", 16);
+                client->in_length = 0;
+            }
+            else
+                memmove(client->in, line, client->in_length);
+        }
+        wal_sync();
+    }
+    if (closed || (events & (EPOLLERR | EPOLLHUP)))
+    {
+        // The client cannot read any more: drop what it has not had.
+        server_close(client);
+        return;
+    }
+    server_send(client);
+}
+
+static void server_listen_handler(event_source_t *source, uint32_t events)
+{
+    server_client_t *client;
+    struct epoll_event event;
+    int fd, slots;
+
+    while ((fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        if (fd >= server_client_slots)
+        {
+            slots = server_client_slots ? server_client_slots : 64;
+            while (fd >= slots)
+                slots *= 2;
+            server_clients = (server_client_t **)realloc(
+                server_clients, slots * sizeof(server_client_t *));
+            if (server_clients == NULL)
+                errno_abort("Allocate client table");
+            memset(server_clients + server_client_slots, 0,
+                   (slots - server_client_slots) * sizeof(server_client_t *));
+            server_client_slots = slots;
+        }
+        client = (server_client_t *)calloc(1, sizeof(server_client_t));
+        if (client == NULL)
+            errno_abort("Allocate client");
+        client->source.fd = fd;
+        client->source.handler = server_client_handler;
+        client->source.arg = client;
+        client->serial = ++server_serial;
+        if (client->serial == 0) // keep owners nonzero
+            client->serial = ++server_serial;
+        client->events = EPOLLIN;
+        event.events = EPOLLIN;
+        event.data.ptr = &client->source;
+        if (epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+            errno_abort("Add client to epoll");
+        server_clients[fd] = client;
+        atomic_fetch_add(&server_connected, 1);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+        && errno != ECONNABORTED && errno != EMFILE && errno != ENFILE)
+        errno_abort("Accept client");
+}
+
+/*
+ * Firings are queued: hand each to its client, if that client is
+ * still the one connected on its fd and is subscribed. A subscriber
+ * too far behind loses the firing rather than stalling the rest.
+ */
+static void server_event_handler(event_source_t *source, uint32_t events)
+{
+    static server_note_t notes[SERVER_NOTES];
+    server_client_t *client;
+    uint64_t value;
+    size_t count, i;
+    char line[MESSAGE_MAX + 32];
+    int status, fd, length;
+
+    if (read(source->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        errno_abort("Read server eventfd");
+
+    status = pthread_mutex_lock(&server_mutex);
+    if (status != 0)
+        err_abort(status, "Lock server mutex");
+    count = server_note_count;
+    for (i = 0; i < count; i++)
+        notes[i] = server_notes[(server_note_first + i) % SERVER_NOTES];
+    server_note_first = (server_note_first + count) % SERVER_NOTES;
+    server_note_count = 0;
+    status = pthread_mutex_unlock(&server_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock server mutex");
+
+    for (i = 0; i < count; i++)
+    {
+        fd = (int)(uint32_t)notes[i].owner;
+        client = fd < server_client_slots ? server_clients[fd] : NULL;
+        if (client == NULL || client->serial != (uint32_t)(notes[i].owner >> 32)
+            || !client->subscribed)
+            continue;
+        if (client->out_length >= SERVER_OUT_MAX)
+        {
+            atomic_fetch_add(&server_dropped, 1);
+            continue;
+        }
+        length = snprintf(line, sizeof(line), "FIRED %d %s\n",
+                          notes[i].alarm_id, notes[i].message->text);
+        server_append(client, line, length);
+        atomic_fetch_add(&server_notified, 1);
+    }
+    // Send once per client, however many firings it got.
+    for (i = 0; i < count; i++)
+    {
+        message_release(notes[i].message);
+        fd = (int)(uint32_t)notes[i].owner;
+        client = fd < server_client_slots ? server_clients[fd] : NULL;
+        if (client != NULL && client->serial == (uint32_t)(notes[i].owner >> 32)
+            && client->out_length > 0 && !(client->events & EPOLLOUT))
+            server_send(client);
+    }
+}
+
+void *server_thread(void *arg)
+{
+    struct epoll_event events[EPOLL_EVENTS];
+    event_source_t *source;
+    int count, i;
+
+    while (1)
+    {
+        count = epoll_wait(server_epoll_fd, events, EPOLL_EVENTS, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Wait on server epoll");
+        }
+        for (i = 0; i < count; i++)
+        {
+            source = (event_source_t *)events[i].data.ptr;
+            source->handler(source, events[i].events);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Bind the server socket (replacing any stale one at the same
+ * path) and start the server thread.
+ */
+void server_open(const char *path)
+{
+    static event_source_t listener, wakeup;
+    struct sockaddr_un address;
+    struct epoll_event event;
+    pthread_t thread;
+    int status;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path \"%s\" is too long\n", path);
+        exit(1);
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path, strlen(path));
+    listener.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener.fd < 0)
+        errno_abort("Create server socket");
+    unlink(path);
+    if (bind(listener.fd, (struct sockaddr *)&address, sizeof(address)) < 0
+        || listen(listener.fd, SOMAXCONN) < 0)
+        errno_abort("Bind server socket");
+    listener.handler = server_listen_handler;
+
+    wakeup.fd = server_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup.fd < 0)
+        errno_abort("Create server eventfd");
+    wakeup.handler = server_event_handler;
+
+    server_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server_epoll_fd < 0)
+        errno_abort("Create server epoll");
+    event.events = EPOLLIN;
+    event.data.ptr = &listener;
+    if (epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, listener.fd, &event) < 0)
+        errno_abort("Add server socket to epoll");
+    event.data.ptr = &wakeup;
+    if (epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, wakeup.fd, &event) < 0)
+        errno_abort("Add server eventfd to epoll");
+
+    status = pthread_create(&thread, NULL, server_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create server thread");
+}
+
+/*
+ * Dump the stats whenever SIGUSR1 arrives. Every other thread has
+ * SIGUSR1 blocked, so this one takes it with sigwait().
+ */
+void *stats_signal_thread(void *arg)
+{
+    sigset_t *signals = (sigset_t *)arg;
+    int status, signal_number;
+
+    while (1)
+    {
+        status = sigwait(signals, &signal_number);
+        if (status != 0)
+            err_abort(status, "Wait for signal");
+        stats_dump();
+    }
+    return NULL;
+}
+
+/*
+ * Thread placement ("-a role:cpus", "-P priority"). Each role's
+ * threads can be pinned to a set of CPUs, one CPU each, round
+ * robin; the consumer (or any role but the timer) can instead ask
+ * for "sibling", the hyperthread siblings of the timer's CPUs, so
+ * it shares a core's caches with the threads that fill its buffer.
+ * The alarm threads can also run SCHED_FIFO at a given priority.
+ * Anything the system refuses (an offline CPU, no permission for
+ * real-time scheduling) leaves the thread where the scheduler puts
+ * it, and the startup report says so.
+ */
+#define ROLE_TIMER 0
+#define ROLE_CONSUMER 1
+#define ROLE_DISPLAY 2
+#define ROLE_EXECUTOR 3
+#define ROLE_WRITER 4
+#define ROLES 5
+
+typedef struct placement_tag
+{
+    const char *name;
+    cpu_set_t cpus;
+    int pinned;   // cpus holds the role's CPUs
+    int sibling;  // ... once resolved from the timer's
+} placement_t;
+
+placement_t placements[ROLES] = {
+    {.name = "timer"}, {.name = "consumer"}, {.name = "display"},
+    {.name = "executor"}, {.name = "writer"}};
+int placement_report;   // any "-a" or "-P": report each thread
+int timer_priority;     // "-P": SCHED_FIFO priority of alarm threads, 0 for none
+
+/*
+ * Parse a CPU list such as "0-3,6" into "cpus". Returns 0 if "text"
+ * is not one.
+ */
+int parse_cpus(const char *text, cpu_set_t *cpus)
+{
+    char *end;
+    long first, last;
+
+    CPU_ZERO(cpus);
+    while (1)
+    {
+        if (*text < '0' || *text > '9')
+            return 0;
+        first = last = strtol(text, &end, 10);
+        if (*end == '-')
+        {
+            if (end[1] < '0' || end[1] > '9')
+                return 0;
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last < first || last >= CPU_SETSIZE)
+            return 0;
+        for (; first <= last; first++)
+            CPU_SET(first, cpus);
+        if (*end == '\0' || *end == '\n')
+            return 1;
+        if (*end != ',')
+            return 0;
+        text = end + 1;
+    }
+}
+
+/*
+ * Format "cpus" as a CPU list, the inverse of parse_cpus().
+ */
+static void format_cpus(const cpu_set_t *cpus, char *text, size_t size)
+{
+    size_t length = 0;
+    int cpu, last;
+
+    text[0] = '\0';
+    for (cpu = 0; cpu < CPU_SETSIZE && length < size; cpu++)
+    {
+        if (!CPU_ISSET(cpu, cpus))
+            continue;
+        for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus); last++)
+            ;
+        if (last == cpu)
+            length += snprintf(text + length, size - length, "%s%d", length ? "," : "", cpu);
+        else
+            length += snprintf(text + length, size - length, "%s%d-%d", length ? "," : "", cpu, last);
+        cpu = last;
+    }
+    if (length == 0)
+        snprintf(text, size, "none");
+}
+
+/*
+ * Parse a placement ("-a"): "<role>:<cpus>", or "<role>:sibling"
+ * for a role other than the timer. Returns 0 if "text" is not one.
+ */
+int parse_placement(const char *text)
+{
+    const char *colon = strchr(text, ':');
+    placement_t *placement;
+    int role;
+
+    if (colon == NULL)
+        return 0;
+    for (role = 0; role < ROLES; role++)
+    {
+        if (strlen(placements[role].name) == (size_t)(colon - text)
+            && strncmp(text, placements[role].name, colon - text) == 0)
+            break;
+    }
+    if (role == ROLES)
+        return 0;
+    placement = &placements[role];
+    placement->pinned = placement->sibling = 0;
+    if (strcmp(colon + 1, "sibling") == 0)
+    {
+        if (role == ROLE_TIMER)
+            return 0;
+        placement->sibling = 1;
+    }
+    else if (parse_cpus(colon + 1, &placement->cpus))
+        placement->pinned = 1;
+    else
+        return 0;
+    placement_report = 1;
+    return 1;
+}
+
+/*
+ * Resolve "sibling" placements: the CPUs that share a core with
+ * one of the timer's, less the timer's own. Without a pinned timer
+ * or any such CPU (no SMT), the role is left unpinned.
+ */
+static void placement_resolve(void)
+{
+    placement_t *timer = &placements[ROLE_TIMER];
+    cpu_set_t siblings, core;
+    char path[64], list[256];
+    FILE *file;
+    int role, cpu;
+
+    CPU_ZERO(&siblings);
+    for (cpu = 0; timer->pinned && cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &timer->cpus))
+            continue;
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+        if (fgets(list, sizeof(list), file) != NULL && parse_cpus(list, &core))
+            CPU_OR(&siblings, &siblings, &core);
+        fclose(file);
+    }
+    if (timer->pinned)
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &timer->cpus))
+                CPU_CLR(cpu, &siblings);
+    for (role = 0; role < ROLES; role++)
+    {
+        if (!placements[role].sibling)
+            continue;
+        placements[role].cpus = siblings;
+        placements[role].pinned = CPU_COUNT(&siblings) > 0;
+    }
+}
+
+/*
+ * Place the "index"th thread of a role, as configured, and report
+ * where it ended up.
+ */
+static void thread_place(pthread_t thread, int role, int index)
+{
+    placement_t *placement = &placements[role];
+    struct sched_param param;
+    cpu_set_t cpus;
+    char list[256], note[128] = "";
+    int status, policy, cpu, n;
+
+    if (placement->pinned)
+    {
+        // The index'th CPU of the set, round robin.
+        n = index % CPU_COUNT(&placement->cpus);
+        for (cpu = 0; !CPU_ISSET(cpu, &placement->cpus) || n-- > 0; cpu++)
+            ;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        status = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+        if (status != 0)
+            snprintf(note, sizeof(note), " (CPU %d refused: %s)", cpu, strerror(status));
+    }
+    else if (placement->sibling)
+        snprintf(note, sizeof(note), " (no sibling CPUs)");
+    if (role == ROLE_TIMER && timer_priority > 0)
+    {
+        param.sched_priority = timer_priority;
+        status = pthread_setschedparam(thread, SCHED_FIFO, &param);
+        if (status != 0)
+            snprintf(note + strlen(note), sizeof(note) - strlen(note),
+                     " (SCHED_FIFO %d refused: %s)", timer_priority, strerror(status));
+    }
+    if (!placement_report)
+        return;
+
+    status = pthread_getaffinity_np(thread, sizeof(cpus), &cpus);
+    if (status != 0)
+        err_abort(status, "Get thread affinity");
+    format_cpus(&cpus, list, sizeof(list));
+    status = pthread_getschedparam(thread, &policy, &param);
+    if (status != 0)
+        err_abort(status, "Get thread scheduling");
+    if (policy == SCHED_FIFO)
+        output_printf("Thread %s.%d: CPUs %s, SCHED_FIFO %d%s\n", placement->name,
+                      index, list, param.sched_priority, note);
+    else
+        output_printf("Thread %s.%d: CPUs %s, SCHED_OTHER%s\n", placement->name,
+                      index, list, note);
+}
+
+/*
+ * Start the writer, alarm, consumer, periodic display, executor and
+ * stats signal threads.
+ */
+void start_alarm_threads(void)
+{
+    static sigset_t signals;
+    pthread_t consumer, writer, stats;
+    int status, i;
+
+    // Block SIGUSR1 here, so every thread created after inherits it.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    status = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (status != 0)
+        err_abort(status, "Block SIGUSR1");
+    status = pthread_create(
+        &stats, NULL, stats_signal_thread, &signals);
+    if (status != 0)
+        err_abort(status, "Create stats signal thread");
+
+    status = pthread_create(
+        &writer, NULL, output_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create output thread");
+    placement_resolve();
+    thread_place(writer, ROLE_WRITER, 0);
+
+    for (i = 0; i < alarm_shard_count; i++)
+    {
+        status = pthread_create(
+            &alarm_shards[i].thread, NULL,
+            alarm_engine == ENGINE_EPOLL ? alarm_epoll_thread : alarm_thread,
+            &alarm_shards[i]);
+        if (status != 0)
+            err_abort(status, "Create alarm thread");
+        thread_place(alarm_shards[i].thread, ROLE_TIMER, i);
+    }
+    status = pthread_create(
+        &consumer, NULL, consumer_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create consumer thread");
+    thread_place(consumer, ROLE_CONSUMER, 0);
+    for (i = 0; i < alarm_display_count; i++)
+    {
+        status = pthread_create(
+            &alarm_displays[i].thread, NULL, periodic_display_thread,
+            &alarm_displays[i]);
+        if (status != 0)
+            err_abort(status, "Create periodic display thread");
+        thread_place(alarm_displays[i].thread, ROLE_DISPLAY, i);
+    }
+    for (i = 0; i < executor_count; i++)
+    {
+        status = pthread_create(
+            &executor_workers[i].thread, NULL, executor_thread,
+            &executor_workers[i]);
+        if (status != 0)
+            err_abort(status, "Create executor thread");
+        thread_place(executor_workers[i].thread, ROLE_EXECUTOR, i);
+    }
+}
+
+/*
+ * alarm_bench.c includes this file, with ALARM_NO_MAIN defined,
+ * to drive the same code.
+ */
+#ifndef ALARM_NO_MAIN
+int main(int argc, char *argv[])
+{
+    int option, shards, displays = 1, workers = 1, status;
+    size_t index;
+    char line[MESSAGE_MAX + 128];
+    const char *ingest = NULL, *replay = NULL;
+    alarm_request_t request;
+    const alarm_backend_t *backend = &alarm_backends[0];
+    FILE *record = NULL;
+    alarm_time_t record_start = -1, stamp;
+    pthread_t writer;
+
+    shards = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (shards < 1)
+        shards = 1;
+    while ((option = getopt(argc, argv, "a:b:c:d:e:f:n:o:p:r:st:u:w:x:P:T:")) != -1)
+    {
+        switch (option)
+        {
+        case 'a':
+            if (!parse_placement(optarg))
+            {
+                fprintf(stderr, "Bad placement \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b':
+            for (index = 0; index < ALARM_BACKENDS; index++)
+                if (strcmp(optarg, alarm_backends[index].name) == 0)
+                    break;
+            if (index == ALARM_BACKENDS)
+            {
+                fprintf(stderr, "Unknown backend \"%s\"\n", optarg);
+                exit(1);
+            }
+            backend = &alarm_backends[index];
+            break;
+        case 'c':
+            if (strcmp(optarg, "skip") == 0)
+                display_catchup = CATCHUP_SKIP;
+            else if (strcmp(optarg, "coalesce") == 0)
+                display_catchup = CATCHUP_COALESCE;
+            else if (strcmp(optarg, "burst") == 0)
+                display_catchup = CATCHUP_BURST;
+            else
+            {
+                fprintf(stderr, "Unknown catch-up policy \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'e':
+            if (!parse_engine(optarg))
+            {
+                fprintf(stderr, "Unknown engine \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "block") == 0)
+                output_policy = OUTPUT_BLOCK;
+            else if (strcmp(optarg, "drop") == 0)
+                output_policy = OUTPUT_DROP;
+            else
+            {
+                fprintf(stderr, "Unknown output policy \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'd':
+            wal_dir = optarg;
+            break;
+        case 'r':
+            if (strncmp(optarg, "block", 5) == 0
+                && (optarg[5] == '\0'
+                    || (optarg[5] == ':' && parse_delay(optarg + 6, &buffer_timeout))))
+                buffer_policy = BUFFER_BLOCK;
+            else if (strcmp(optarg, "drop-newest") == 0)
+                buffer_policy = BUFFER_DROP_NEWEST;
+            else if (strcmp(optarg, "drop-oldest") == 0)
+                buffer_policy = BUFFER_DROP_OLDEST;
+            else if (strcmp(optarg, "spill") == 0)
+                buffer_policy = BUFFER_SPILL;
+            else
+            {
+                fprintf(stderr, "Unknown backpressure policy \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            ingest = optarg;
+            break;
+        case 'P':
+            timer_priority = atoi(optarg);
+            if (timer_priority < 1 || timer_priority > sched_get_priority_max(SCHED_FIFO))
+            {
+                fprintf(stderr, "Bad timer priority \"%s\"\n", optarg);
+                exit(1);
+            }
+            placement_report = 1;
+            break;
+        case 'p':
+            displays = atoi(optarg);
+            if (displays < 1)
+            {
+                fprintf(stderr, "Bad display thread count \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            stats_enabled = 1;
+            break;
+        case 't':
+            replay = optarg;
+            break;
+        case 'T':
+            record = fopen(optarg, "w");
+            if (record == NULL)
+                errno_abort("Open trace record");
+            break;
+        case 'u':
+            server_path = optarg;
+            break;
+        case 'x':
+            workers = atoi(optarg);
+            if (workers < 1)
+            {
+                fprintf(stderr, "Bad executor thread count \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'w':
+            if (!parse_delay(optarg, &alarm_slack))
+            {
+                fprintf(stderr, "Bad slack \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'n':
+            shards = atoi(optarg);
+            if (shards < 1)
+            {
+                fprintf(stderr, "Bad shard count \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-a role:cpus|sibling] [-b wheel|list|heap] [-c skip|coalesce|burst]\n"
+                            "       [-d dir] [-e cond|epoll[:adaptive|window]] [-f file] [-n shards] [-o block|drop]\n"
+                            "       [-P priority] [-p displays] [-r block[:timeout]|drop-newest|drop-oldest|spill]\n"
+                            "       [-s] [-t trace] [-T trace] [-u socket] [-w slack] [-x workers]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (replay != NULL)
+    {
+        if (wal_dir != NULL || server_path != NULL)
+        {
+            fprintf(stderr, "A replay (-t) cannot log (-d) or serve (-u)\n");
+            exit(1);
+        }
+        // One thread does everything, so nothing may block on room.
+        alarm_clock = &alarm_clocks[1];
+        alarm_engine = ENGINE_COND;
+        buffer_policy = BUFFER_SPILL;
+        initialize_alarm_system(backend, shards, displays, workers);
+        status = pthread_create(&writer, NULL, output_thread, NULL);
+        if (status != 0)
+            err_abort(status, "Create output thread");
+        if (ingest != NULL)
+            ingest_file(ingest);
+        simulate(replay);
+        exit(0);
+    }
+    initialize_alarm_system(backend, shards, displays, workers);
+    start_alarm_threads();
+    if (wal_dir != NULL)
+        wal_open();
+    if (server_path != NULL)
+        server_open(server_path);
+    if (ingest != NULL)
+    {
+        ingest_file(ingest);
+        output_flush();
+    }
+    while (1)
+    {
+        output_printf("Alarm> ");
+        output_flush();
+        if (fgets(line, sizeof(line), stdin) == NULL)
+        {
+            output_drain();
+            // Keep serving socket clients without stdin.
+            if (server_path != NULL)
+                pthread_exit(NULL);
+            exit(0);
+        }
+        if (record != NULL)
+        {
+            // A trace for "-t": each command, stamped with its time.
+            stamp = alarm_now();
+            if (record_start < 0)
+                record_start = stamp;
+            fprintf(record, "@%lldns %s", (long long)(stamp - record_start), line);
+            fflush(record);
+        }
+        parse_request(line, line + strcspn(line, "\n"), &request);
+        process_alarm_request(&request);
+        // Acknowledge nothing (at the next prompt) until it is durable.
+        wal_sync();
+    }
+}
+#endif
+
+static void lateness_record(alarm_t **batch, size_t count)
+{
+    size_t i;
+    int status;
+
+    status = pthread_mutex_lock(&lateness_mutex);
+    if (status != 0)
+        err_abort(status, "Lock lateness mutex");
+    for (i = 0; i < count; i++)
+        histogram_record(&lateness_histogram,
+                         batch[i]->fired_time - batch[i]->scheduled_time);
+    status = pthread_mutex_unlock(&lateness_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock lateness mutex");
+}
+
+/*
+ * The consumer thread's start routine. Drain expired alarms from
+ * the circular buffer in batches, record how late they fired, and
+ * hand them to the executor to run their actions.
+ */
+void *consumer_thread(void *arg)
+{
+    alarm_t *batch[CONSUMER_BATCH];
+    size_t count;
+    int spins = 0;
+
+    while (1)
+    {
+        count = buffer_get(&alarm_buffer, batch, CONSUMER_BATCH);
+        if (count == 0)
+        {
+            if (++spins < BUFFER_SPIN)
+                cpu_relax();
+            else
+            {
+                buffer_wait(&alarm_buffer);
+                spins = 0;
+            }
+            continue;
+        }
+        spins = 0;
+        lateness_record(batch, count);
+        executor_submit(batch, count);
+    }
+    return NULL;
+}
+
+/*
+ * Display the alarms at the top of the list that are due at "now".
+ * Each alarm's next display is its last deadline plus its interval,
+ * never "now" plus its interval, so displays do not drift. Returns
+ * nonzero if anything was displayed. The caller holds the list.
+ */
+static int display_due(alarm_display_t *display, alarm_time_t now)
+{
+    alarm_t *alarm;
+    alarm_time_t late, missed;
+    int displayed = 0;
+
+    while (display->list.size > 0
+           && display->list.key[0] <= now)
+    {
+        alarm = display->list.node[0];
+        displayed = 1;
+        late = now - alarm->scheduled_time;
+        // Whole periods missed; alarm_retire() keeps a zero period out.
+        missed = alarm->interval > 0 ? late / alarm->interval : 0;
+        if (missed == 0 || display_catchup == CATCHUP_BURST)
+        {
+            output_printf("ALARM MESSAGE (%d) PRINTED BY ALARM DISPLAY THREAD: TIME = %.6f MESSAGE = %s\n",
+                          alarm->alarm_id, (double)alarm->scheduled_time / NSEC_PER_SEC, alarm->message->text);
+            alarm->scheduled_time += alarm->interval;
+        }
+        else if (display_catchup == CATCHUP_COALESCE)
+        {
+            output_printf("ALARM MESSAGE (%d) PRINTED BY ALARM DISPLAY THREAD: TIME = %.6f MESSAGE = %s (%lld PERIODS)\n",
+                          alarm->alarm_id, (double)alarm->scheduled_time / NSEC_PER_SEC, alarm->message->text,
+                          (long long)missed + 1);
+            alarm->scheduled_time += (missed + 1) * alarm->interval;
+        }
+        else
+            alarm->scheduled_time += (missed + 1) * alarm->interval;
+        if (alarm->owner != 0)
+            server_notify(alarm);
+        heap_fix(&display->list, 0);
+    }
+    return displayed;
+}
+
+/*
+ * The periodic display thread's start routine; there is one per
+ * display list, passed in "arg". Each wakeup touches only the
+ * alarms that are due, then sleeps until the next one is, by an
+ * absolute deadline on CLOCK_MONOTONIC, or until an executor worker
+ * posts an earlier one.
+ */
+void *periodic_display_thread(void *arg)
+{
+    alarm_display_t *display = (alarm_display_t *)arg;
+    alarm_time_t deadline;
+    struct timespec cond_time;
+    int status, displayed;
+
+    while (1)
+    {
+        display_lock(display);
+        displayed = display_due(display, alarm_now());
+
+        /*
+         * Publish the deadline, then look at the inbox once more: an
+         * alarm posted before the executor could see the deadline
+         * would otherwise wait for the deadline.
+         */
+        deadline = display->list.size > 0 ? display->list.key[0] : 0;
+        atomic_store(&display->deadline, deadline);
+        display_unlock(display);
+        // Queue any output with the list unlocked, in case we have to wait.
+        output_flush();
+        if (displayed || atomic_load(&display->inbox) != NULL)
+            continue;
+
+        if (deadline == 0)
+            status = sem_wait(&display->wakeup);
+        else
+        {
+            alarm_timespec(deadline, &cond_time);
+            status = sem_clockwait(&display->wakeup, CLOCK_MONOTONIC, &cond_time);
+        }
+        if (status != 0 && errno != ETIMEDOUT && errno != EINTR)
+            errno_abort("Wait for display wakeup");
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Alarms due together fire in deadline order, then id order, so
+ * which shard held each one does not matter.
+ */
+static int simulate_compare(const void *a, const void *b)
+{
+    const alarm_t *x = *(alarm_t *const *)a, *y = *(alarm_t *const *)b;
+
+    if (x->scheduled_time != y->scheduled_time)
+        return x->scheduled_time < y->scheduled_time ? -1 : 1;
+    return (x->alarm_id > y->alarm_id) - (x->alarm_id < y->alarm_id);
+}
+
+/*
+ * Do, at the current virtual time, what the alarm, consumer,
+ * executor and display threads would: fire what is due, run the
+ * actions, and show due periodic alarms. Returns the number fired.
+ */
+static long simulate_due(void)
+{
+    static alarm_t **due;
+    static size_t due_size;
+    alarm_display_t *display;
+    size_t count = 0, got, batch, i;
+    int index;
+
+    for (index = 0; index < alarm_shard_count; index++)
+    {
+        shard_lock(&alarm_shards[index]);
+        shard_expire(&alarm_shards[index], virtual_time);
+        shard_unlock(&alarm_shards[index]);
+    }
+    do
+    {
+        if (count + CONSUMER_BATCH > due_size)
+        {
+            due_size = due_size ? due_size * 2 : 4 * CONSUMER_BATCH;
+            due = (alarm_t **)realloc(due, due_size * sizeof(alarm_t *));
+            if (due == NULL)
+                errno_abort("Allocate due alarms");
+        }
+        got = buffer_get(&alarm_buffer, due + count, CONSUMER_BATCH);
+        count += got;
+    } while (got > 0);
+    qsort(due, count, sizeof(alarm_t *), simulate_compare);
+    for (batch = 0; batch < count; batch += CONSUMER_BATCH)
+    {
+        got = count - batch < CONSUMER_BATCH ? count - batch : CONSUMER_BATCH;
+        lateness_record(due + batch, got);
+        for (i = batch; i < batch + got; i++)
+        {
+            due[i]->action(due[i]);
+            alarm_retire(due[i]);
+        }
+    }
+    for (index = 0; index < alarm_display_count; index++)
+    {
+        display = &alarm_displays[index];
+        display_lock(display);
+        display_due(display, virtual_time);
+        display_unlock(display);
+        // No display thread is waiting for these.
+        while (sem_trywait(&display->wakeup) == 0)
+            ;
+    }
+    output_flush();
+    return (long)count;
+}
+
+/*
+ * The virtual time at which something is next due; INT64_MAX if
+ * nothing is pending. Periodic alarms count only if "periodic" is
+ * set, as they are always pending.
+ */
+static alarm_time_t simulate_next(int periodic)
+{
+    alarm_shard_t *shard;
+    alarm_display_t *display;
+    alarm_time_t next = INT64_MAX, when;
+    int index;
+
+    for (index = 0; index < alarm_shard_count; index++)
+    {
+        shard = &alarm_shards[index];
+        shard_lock(shard);
+        if (shard->store.count > 0)
+        {
+            when = shard->store.backend->next_deadline(&shard->store);
+            if (when < next)
+                next = when;
+        }
+        shard_unlock(shard);
+    }
+    for (index = 0; periodic && index < alarm_display_count; index++)
+    {
+        display = &alarm_displays[index];
+        display_lock(display);
+        if (display->list.size > 0 && display->list.key[0] < next)
+            next = display->list.key[0];
+        display_unlock(display);
+    }
+    return next;
+}
+
+/*
+ * Replay a command trace ("-t trace") under the virtual clock, as
+ * fast as the CPU allows: the clock jumps straight to whichever
+ * comes first, the next command or the next deadline. Each line is
+ * a command, optionally preceded by "@<time>", the virtual time
+ * since the replay started at which it is given (the same time as
+ * the line before if there is none). A line of just "@<time>" runs
+ * the replay on until then and ends it; without one, the replay
+ * ends when the trace has ended and no one-shot alarm is pending.
+ * Alarms due at the same time as a command fire first, and alarms
+ * due together fire in deadline, then id, order, however many
+ * shards there are. One thread does all the work, so the output
+ * depends on nothing but the trace and the backend, and two runs,
+ * even on different machines, can be diffed.
+ *
+ * The clock jumps to the deadline the backend reports, and fires
+ * what the backend then has due. The "list" and "heap" backends
+ * are exact, so alarms fire on time; the wheel rounds
+ * deadlines up to its 65.5us tick, so under "-b wheel" alarms fire
+ * up to a tick late (and report that lateness), and a command that
+ * falls inside the tick comes before the alarm. Compare replays
+ * made with the same backend.
+ */
+void simulate(const char *path)
+{
+    FILE *trace;
+    char line[MESSAGE_MAX + 128], *command = NULL, *stamp_end;
+    alarm_request_t request;
+    alarm_time_t when = 0, stop = -1, next, start = monotonic_now();
+    long fired = 0, commands = 0;
+    int have_command = 0, ended = 0;
+
+    trace = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (trace == NULL)
+        errno_abort("Open trace");
+    virtual_time = 0;
+    while (1)
+    {
+        // Read the next command, unless one is waiting for its time.
+        while (!have_command && stop < 0 && !ended)
+        {
+            if (fgets(line, sizeof(line), trace) == NULL)
+            {
+                ended = 1;
+                break;
+            }
+            command = line;
+            if (line[0] == '@')
+            {
+                stamp_end = line + 1 + strcspn(line + 1, " \t\r\n");
+                command = stamp_end + strspn(stamp_end, " \t\r\n");
+                *stamp_end = '\0';
+                if (!parse_delay(line + 1, &when))
+                {
+                    fprintf(stderr, "Bad trace time \"%s\"\n", line + 1);
+                    continue;
+                }
+                if (*command == '\0')
+                {
+                    stop = when;
+                    break;
+                }
+            }
+            have_command = 1;
+        }
+
+        fired += simulate_due();
+        next = simulate_next(!ended || stop >= 0);
+        if (have_command && when < next)
+        {
+            if (when > virtual_time)
+                virtual_time = when;
+            parse_request(command, command + strcspn(command, "\n"), &request);
+            process_alarm_request(&request);
+            commands++;
+            have_command = 0;
+            continue;
+        }
+        if (next == INT64_MAX || (stop >= 0 && next > stop))
+            break;
+        if (next > virtual_time)
+            virtual_time = next;
+    }
+    if (stop > virtual_time)
+        virtual_time = stop;
+    if (trace != stdin)
+        fclose(trace);
+    output_drain();
+    fprintf(stderr, "Replayed %ld commands and %ld firings to %.6fs of virtual time in %.3fs\n",
+            commands, fired, (double)virtual_time / NSEC_PER_SEC,
+            (double)(monotonic_now() - start) / NSEC_PER_SEC);
+}
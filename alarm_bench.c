@@ -0,0 +1,358 @@
+/*
+ * alarm_bench.c
+ *
+ * Load generator and latency benchmark for the alarm engine in
+ * New_Alarm_Cond.c, which it includes, so it runs exactly the code
+ * main() does: create_alarm(), change_alarm() and cancel_alarm(),
+ * with the real alarm, consumer and writer threads behind them.
+ *
+ *   cc -O2 -pthread alarm_bench.c -o alarm_bench
+ *
+ * Each of "-t" threads runs "-a" operations, picked at random by
+ * the "-m insert:change:cancel" mix (in percent). Change and cancel
+ * act on a random alarm the same thread created; an alarm that has
+ * already fired counts as "missed". New alarms are one-shot, due
+ * after a delay drawn uniformly from "-d min,max". When every
+ * thread is done the benchmark waits (up to "-w" seconds) for the
+ * remaining alarms to fire, then reports the throughput of each
+ * operation and a histogram of firing lateness. "-b", "-e", "-n"
+ * and "-x" are as for the alarm program, and "-l" is its "-w"
+ * (slack); with a spinning engine ("-e cond:adaptive") it also
+ * reports each shard's spins and how late its wakeups were. Each
+ * alarm's action busy-waits for "-c" (default 0), standing in for
+ * real work; a second histogram shows how late the actions
+ * started. The report goes to stdout.
+ */
+#define ALARM_NO_MAIN
+#include "New_Alarm_Cond.c"
+
+#define BENCH_INSERT 0
+#define BENCH_CHANGE 1
+#define BENCH_CANCEL 2
+#define BENCH_OPS 3
+
+typedef struct bench_thread_tag
+{
+    pthread_t thread;
+    uint64_t seed;
+    int *ids;                     // alarms created and not cancelled
+    long id_count;
+    long ops[BENCH_OPS];
+    long missed[BENCH_OPS];       // change or cancel after the alarm fired
+    alarm_time_t time[BENCH_OPS]; // spent in each operation
+} bench_thread_t;
+
+long bench_count = 100000;
+int bench_mix[BENCH_OPS] = {80, 10, 10};
+alarm_time_t bench_min = 1000000, bench_max = 1000000000;
+alarm_time_t bench_cost;           // "-c": busy time per action
+histogram_t action_histogram;      // action start - scheduled_time; action_mutex
+pthread_mutex_t action_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t bench_random(bench_thread_t *self)
+{
+    // xorshift64*
+    self->seed ^= self->seed >> 12;
+    self->seed ^= self->seed << 25;
+    self->seed ^= self->seed >> 27;
+    return self->seed * 2685821657736338717ULL;
+}
+
+static void bench_action(alarm_t *alarm)
+{
+    alarm_time_t start = alarm_now();
+    int status;
+
+    status = pthread_mutex_lock(&action_mutex);
+    if (status != 0)
+        err_abort(status, "Lock action mutex");
+    histogram_record(&action_histogram, start - alarm->scheduled_time);
+    status = pthread_mutex_unlock(&action_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock action mutex");
+    while (alarm_now() - start < bench_cost)
+        cpu_relax();
+}
+
+void *bench_thread(void *arg)
+{
+    bench_thread_t *self = (bench_thread_t *)arg;
+    alarm_request_t request = {.type = REQUEST_ALARM, .slack = -1,
+                               .message = "bench", .message_length = 5};
+    alarm_time_t start, delay;
+    long i, slot;
+    int op, roll;
+
+    self->ids = (int *)malloc(bench_count * sizeof(int));
+    if (self->ids == NULL)
+        errno_abort("Allocate ids");
+    for (i = 0; i < bench_count; i++)
+    {
+        roll = (int)(bench_random(self) % 100);
+        if (self->id_count == 0 || roll < bench_mix[BENCH_INSERT])
+            op = BENCH_INSERT;
+        else if (roll < bench_mix[BENCH_INSERT] + bench_mix[BENCH_CHANGE])
+            op = BENCH_CHANGE;
+        else
+            op = BENCH_CANCEL;
+        delay = bench_min;
+        if (bench_max > bench_min)
+            delay += (alarm_time_t)(bench_random(self) % (uint64_t)(bench_max - bench_min));
+        slot = self->id_count > 0 ? (long)(bench_random(self) % self->id_count) : 0;
+
+        start = alarm_now();
+        switch (op)
+        {
+        case BENCH_INSERT:
+            request.delay = delay;
+            self->ids[self->id_count++] = create_alarm(&request, 0, bench_action);
+            break;
+        case BENCH_CHANGE:
+            if (change_alarm(self->ids[slot], delay, -1, "bench changed", 13) <= 0)
+                self->missed[op]++;
+            break;
+        case BENCH_CANCEL:
+            if (!cancel_alarm(self->ids[slot]))
+                self->missed[op]++;
+            self->ids[slot] = self->ids[--self->id_count];
+            break;
+        }
+        self->time[op] += alarm_now() - start;
+        self->ops[op]++;
+    }
+    free(self->ids);
+    return NULL;
+}
+
+static void report_lateness(FILE *report, const char *name, const histogram_t *histogram)
+{
+    static const double percentiles[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+    size_t i;
+
+    fprintf(report, "%s: %ld fired", name, histogram->total);
+    if (histogram->total > 0)
+    {
+        for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+            fprintf(report, ", p%g %.1fus", percentiles[i] * 100,
+                    histogram_percentile(histogram, percentiles[i]) / 1000.0);
+        fprintf(report, ", max %.1fus", histogram->max / 1000.0);
+    }
+    fprintf(report, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *op_names[BENCH_OPS] = {"insert", "change", "cancel"};
+    const alarm_backend_t *backend = &alarm_backends[0];
+    bench_thread_t *threads;
+    alarm_time_t start, elapsed, wait = 60 * NSEC_PER_SEC, deadline;
+    alarm_time_t spin_time, window;
+    long ops, missed, total = 0, spins;
+    alarm_time_t time;
+    int option, shards, thread_count = 1, workers = 1, status, i, op, null_fd;
+    size_t index, max_depth;
+    char *comma, name[64];
+    histogram_t histogram;
+    FILE *report;
+
+    shards = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (shards < 1)
+        shards = 1;
+    while ((option = getopt(argc, argv, "a:b:c:d:e:l:m:n:t:w:x:")) != -1)
+    {
+        switch (option)
+        {
+        case 'a':
+            bench_count = atol(optarg);
+            break;
+        case 'b':
+            for (index = 0; index < ALARM_BACKENDS; index++)
+                if (strcmp(optarg, alarm_backends[index].name) == 0)
+                    break;
+            if (index == ALARM_BACKENDS)
+            {
+                fprintf(stderr, "Unknown backend \"%s\"\n", optarg);
+                exit(1);
+            }
+            backend = &alarm_backends[index];
+            break;
+        case 'c':
+            if (!parse_delay(optarg, &bench_cost))
+            {
+                fprintf(stderr, "Bad action cost \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'd':
+            comma = strchr(optarg, ',');
+            if (comma != NULL)
+                *comma = '\0';
+            if (!parse_delay(optarg, &bench_min)
+                || (comma != NULL && !parse_delay(comma + 1, &bench_max))
+                || (comma == NULL && !parse_delay(optarg, &bench_max))
+                || bench_max < bench_min)
+            {
+                fprintf(stderr, "Bad delay range\n");
+                exit(1);
+            }
+            break;
+        case 'e':
+            if (!parse_engine(optarg))
+            {
+                fprintf(stderr, "Unknown engine \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'l':
+            if (!parse_delay(optarg, &alarm_slack))
+            {
+                fprintf(stderr, "Bad slack \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d:%d:%d", &bench_mix[BENCH_INSERT],
+                       &bench_mix[BENCH_CHANGE], &bench_mix[BENCH_CANCEL]) != 3
+                || bench_mix[BENCH_INSERT] + bench_mix[BENCH_CHANGE]
+                           + bench_mix[BENCH_CANCEL] != 100)
+            {
+                fprintf(stderr, "Mix must be insert:change:cancel percentages adding to 100\n");
+                exit(1);
+            }
+            break;
+        case 'n':
+            shards = atoi(optarg);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            break;
+        case 'w':
+            if (!parse_delay(optarg, &wait))
+            {
+                fprintf(stderr, "Bad wait \"%s\"\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'x':
+            workers = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-a ops] [-b wheel|list|heap] [-c cost] [-d min,max]\n"
+                            "       [-e cond|epoll[:adaptive|window]] [-l slack] [-m insert:change:cancel] [-n shards]\n"
+                            "       [-t threads] [-w wait] [-x workers]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (shards < 1 || thread_count < 1 || workers < 1 || bench_count < 1)
+    {
+        fprintf(stderr, "Shards, threads, workers and ops must be positive\n");
+        exit(1);
+    }
+
+    // Keep the report on stdout, and send the firings to /dev/null.
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    null_fd = open("/dev/null", O_WRONLY);
+    if (report == NULL || null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0)
+        errno_abort("Redirect stdout");
+    close(null_fd);
+
+    initialize_alarm_system(backend, shards, 1, workers);
+    start_alarm_threads();
+
+    threads = (bench_thread_t *)calloc(thread_count, sizeof(bench_thread_t));
+    if (threads == NULL)
+        errno_abort("Allocate threads");
+    start = alarm_now();
+    for (i = 0; i < thread_count; i++)
+    {
+        threads[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        status = pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]);
+        if (status != 0)
+            err_abort(status, "Create bench thread");
+    }
+    for (i = 0; i < thread_count; i++)
+    {
+        status = pthread_join(threads[i].thread, NULL);
+        if (status != 0)
+            err_abort(status, "Join bench thread");
+    }
+    elapsed = alarm_now() - start;
+
+    fprintf(report, "backend %s, engine %s, %d shards, %d workers, %d threads, %ld ops each, mix %d:%d:%d\n",
+            backend->name, alarm_engine == ENGINE_EPOLL ? "epoll" : "cond",
+            shards, workers, thread_count, bench_count,
+            bench_mix[BENCH_INSERT], bench_mix[BENCH_CHANGE], bench_mix[BENCH_CANCEL]);
+    for (op = 0; op < BENCH_OPS; op++)
+    {
+        ops = missed = time = 0;
+        for (i = 0; i < thread_count; i++)
+        {
+            ops += threads[i].ops[op];
+            missed += threads[i].missed[op];
+            time += threads[i].time[op];
+        }
+        total += ops;
+        fprintf(report, "%s: %ld ops, %.0f ns/op, %.0f ops/s per thread",
+                op_names[op], ops, ops ? (double)time / ops : 0.0,
+                time ? (double)ops * NSEC_PER_SEC / time : 0.0);
+        if (op != BENCH_INSERT)
+            fprintf(report, ", %ld missed", missed);
+        fprintf(report, "\n");
+    }
+    fprintf(report, "total: %ld ops in %.3fs, %.0f ops/s\n",
+            total, (double)elapsed / NSEC_PER_SEC,
+            (double)total * NSEC_PER_SEC / elapsed);
+
+    // Wait for the outstanding alarms to fire (and be freed).
+    deadline = alarm_now() + wait;
+    while (atomic_load(&pool_in_use) > 0 && alarm_now() < deadline)
+        usleep(10000);
+    if (atomic_load(&pool_in_use) > 0)
+        fprintf(report, "gave up waiting for %ld alarms\n", atomic_load(&pool_in_use));
+    // Copy what the engine's threads may still be writing under its locks.
+    status = pthread_mutex_lock(&lateness_mutex);
+    if (status != 0)
+        err_abort(status, "Lock lateness mutex");
+    histogram = lateness_histogram;
+    status = pthread_mutex_unlock(&lateness_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock lateness mutex");
+    report_lateness(report, "lateness", &histogram);
+    status = pthread_mutex_lock(&action_mutex);
+    if (status != 0)
+        err_abort(status, "Lock action mutex");
+    histogram = action_histogram;
+    status = pthread_mutex_unlock(&action_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock action mutex");
+    report_lateness(report, "action lateness", &histogram);
+    for (i = 0; i < workers; i++)
+    {
+        status = pthread_mutex_lock(&executor_workers[i].mutex);
+        if (status != 0)
+            err_abort(status, "Lock executor deque");
+        max_depth = executor_workers[i].max_depth;
+        status = pthread_mutex_unlock(&executor_workers[i].mutex);
+        if (status != 0)
+            err_abort(status, "Unlock executor deque");
+        fprintf(report, "worker %d: %ld executed, %ld stolen, max depth %zu\n", i,
+                atomic_load(&executor_workers[i].executed),
+                atomic_load(&executor_workers[i].steals), max_depth);
+    }
+    for (i = 0; spin_mode != SPIN_OFF && i < shards; i++)
+    {
+        shard_lock(&alarm_shards[i]);
+        histogram = alarm_shards[i].wakeup_late;
+        spins = alarm_shards[i].spins;
+        spin_time = alarm_shards[i].spin_time;
+        window = spin_window(&alarm_shards[i]);
+        shard_unlock(&alarm_shards[i]);
+        snprintf(name, sizeof(name), "shard %d wakeup", i);
+        report_lateness(report, name, &histogram);
+        fprintf(report, "shard %d: %ld spins, %.3fms spinning, window %.1fus\n", i,
+                spins, spin_time / 1e6, window / 1000.0);
+    }
+    fclose(report);
+    return 0;
+}
@@ -0,0 +1,580 @@
+/*
+ * alarm_test.c
+ *
+ * Regression tests for the alarm engine in New_Alarm_Cond.c, which
+ * it includes, as alarm_bench.c does, so the tests drive the same
+ * code main() does, with the real alarm, consumer, executor and
+ * display threads running behind them.
+ *
+ *   cc -O2 -pthread alarm_test.c -o alarm_test && ./alarm_test
+ *
+ * Each test prints its name as it passes; the first failed check
+ * prints where it is and exits 1. The engine's own output goes to
+ * /dev/null.
+ */
+#define ALARM_NO_MAIN
+#include "New_Alarm_Cond.c"
+
+#define CHECK(condition) do { \
+    if (!(condition)) \
+    { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        exit(1); \
+    } \
+    } while (0)
+
+FILE *test_report;
+
+/*
+ * Parse and carry out one command, as a socket client's would be.
+ */
+static int test_request(const char *line)
+{
+    alarm_request_t request;
+
+    CHECK(parse_request(line, line + strlen(line), &request) != REQUEST_BAD);
+    return execute_request(&request, 0);
+}
+
+/*
+ * A periodic alarm may not be changed to a delay of 0: its display
+ * thread divides by the period. A period of 0 that gets in anyway
+ * (from an old log) is retired like a one-shot alarm.
+ */
+static void test_periodic_zero_delay(void)
+{
+    char line[64];
+    alarm_shard_t *shard;
+    alarm_t *alarm;
+    alarm_time_t interval;
+    long in_use;
+    int alarm_id;
+
+    alarm_id = test_request("Periodic 1s hello");
+    CHECK(alarm_id > 0);
+    snprintf(line, sizeof(line), "Change %d 0 zero", alarm_id);
+    CHECK(test_request(line) == -1);
+    snprintf(line, sizeof(line), "Change %d 0.5s half", alarm_id);
+    CHECK(test_request(line) == alarm_id);
+    shard = shard_of(alarm_id);
+    shard_lock(shard);
+    interval = store_find(&shard->store, alarm_id)->interval;
+    shard_unlock(shard);
+    CHECK(interval == NSEC_PER_SEC / 2);
+    snprintf(line, sizeof(line), "Cancel %d", alarm_id);
+    CHECK(test_request(line) == alarm_id);
+
+    // A one-shot alarm may still be changed to fire at once.
+    alarm_id = test_request("10s once");
+    snprintf(line, sizeof(line), "Change %d 0 now", alarm_id);
+    CHECK(test_request(line) == alarm_id);
+
+    alarm = alarm_alloc();
+    alarm->alarm_id = atomic_fetch_add(&next_alarm_id, 1);
+    alarm->periodic = 1;
+    alarm->message = message_intern("zero", 4);
+    in_use = atomic_load(&pool_in_use);
+    alarm_retire(alarm);
+    CHECK(atomic_load(&pool_in_use) == in_use - 1);
+    fprintf(test_report, "periodic_zero_delay\n");
+}
+
+#define STORE_ALARMS 512
+
+/*
+ * Drive each backend's store through random inserts, removes,
+ * reschedules and expiries, checking it against a plain array. No
+ * backend may expire an alarm early, and only the wheel, which
+ * rounds deadlines up to a tick, may hold a due alarm back (or
+ * report a deadline up to a tick late). Alarm objects are recycled
+ * through the pool between backends, so each backend must reset
+ * whatever position another left in them.
+ */
+static void test_store_backends(void)
+{
+    alarm_t *pending[STORE_ALARMS], *alarm;
+    alarm_store_t store;
+    alarm_time_t base, now, when, last_time, hold;
+    unsigned seed = 1;
+    size_t backend;
+    int count, i, op, last_id;
+
+    for (backend = 0; backend < ALARM_BACKENDS; backend++)
+    {
+        memset(&store, 0, sizeof(store));
+        store.backend = &alarm_backends[backend];
+        index_init(&store.index, 16);
+        store.backend->init(&store);
+        hold = strcmp(store.backend->name, "wheel") == 0
+               ? (alarm_time_t)1 << WHEEL_TICK_SHIFT : 0;
+        base = now = alarm_now();
+        count = 0;
+        for (op = 0; op < 20000; op++)
+        {
+            when = now + rand_r(&seed) % (NSEC_PER_SEC / 10);
+            switch (rand_r(&seed) % 4)
+            {
+            case 0:
+                if (count == STORE_ALARMS)
+                    break;
+                alarm = alarm_alloc();
+                alarm->alarm_id = atomic_fetch_add(&next_alarm_id, 1);
+                alarm->scheduled_time = when;
+                store_add(&store, alarm);
+                pending[count++] = alarm;
+                break;
+            case 1:
+                if (count == 0)
+                    break;
+                i = rand_r(&seed) % count;
+                CHECK(store_find(&store, pending[i]->alarm_id) == pending[i]);
+                store_remove(&store, pending[i]);
+                alarm_free(pending[i]);
+                pending[i] = pending[--count];
+                break;
+            case 2:
+                if (count == 0)
+                    break;
+                store_reschedule(&store, pending[rand_r(&seed) % count], when);
+                break;
+            default:
+                now += rand_r(&seed) % (NSEC_PER_SEC / 50);
+                last_time = 0;
+                last_id = 0;
+                while ((alarm = store_expire(&store, now)) != NULL)
+                {
+                    CHECK(alarm->scheduled_time <= now);
+                    if (hold == 0)
+                        CHECK(alarm->scheduled_time > last_time
+                              || (alarm->scheduled_time == last_time
+                                  && alarm->alarm_id > last_id));
+                    last_time = alarm->scheduled_time;
+                    last_id = alarm->alarm_id;
+                    for (i = 0; i < count && pending[i] != alarm; i++)
+                        ;
+                    CHECK(i < count);
+                    pending[i] = pending[--count];
+                    alarm_free(alarm);
+                }
+                for (i = 0; i < count; i++)
+                {
+                    CHECK(pending[i]->scheduled_time + hold > now);
+                    CHECK(store.backend->next_deadline(&store)
+                          <= pending[i]->scheduled_time + hold);
+                }
+                break;
+            }
+            CHECK(store.count == count);
+        }
+        while ((alarm = store_expire(&store, base + NSEC_PER_SEC * 3600)) != NULL)
+        {
+            alarm_free(alarm);
+            count--;
+        }
+        CHECK(count == 0 && store.count == 0);
+        fprintf(test_report, "store_backend %s\n", store.backend->name);
+    }
+}
+
+/*
+ * A range walked from the top down starts at the last alarm due at
+ * or before its end, even one whose id is INT32_MAX.
+ */
+static void test_range_last(void)
+{
+    static const int ids[] = {5, INT32_MAX, 7, 1};
+    alarm_t *added[4];
+    alarm_store_t store;
+    alarm_time_t when = alarm_now();
+    int i;
+
+    memset(&store, 0, sizeof(store));
+    store.backend = &alarm_backends[0];
+    index_init(&store.index, 16);
+    store.backend->init(&store);
+    for (i = 0; i < 4; i++)
+    {
+        added[i] = alarm_alloc();
+        added[i]->alarm_id = ids[i];
+        added[i]->scheduled_time = i < 3 ? when : when + 1;
+        store_add(&store, added[i]);
+    }
+    CHECK(range_last(&store, when - 1) == NULL);
+    CHECK(range_last(&store, when) == added[1]);
+    CHECK(range_prev(&store, when, INT32_MAX) == added[2]);
+    CHECK(range_last(&store, INT64_MAX) == added[3]);
+    for (i = 0; i < 4; i++)
+    {
+        store_remove(&store, added[i]);
+        alarm_free(added[i]);
+    }
+    CHECK(store.count == 0);
+    fprintf(test_report, "range_last\n");
+}
+
+/*
+ * With "-r block", an alarm thread waiting for room in a full
+ * buffer must not hold its shard: inserts go on meanwhile. Holding
+ * lateness_mutex stalls the consumer, so enough due alarms fill the
+ * buffer. Should an insert hang, SIGALRM ends the test.
+ */
+static void test_block_unlocked(void)
+{
+    struct timespec pause = {0, 1000000};
+    char line[64];
+    long full;
+    int status, i, alarm_id;
+
+    CHECK(buffer_policy == BUFFER_BLOCK && buffer_timeout == 0);
+    full = atomic_load(&alarm_buffer.full);
+    status = pthread_mutex_lock(&lateness_mutex);
+    if (status != 0)
+        err_abort(status, "Lock lateness mutex");
+    alarm(10);
+    for (i = 0; i < BUFFER_SLOTS + 4 * CONSUMER_BATCH; i++)
+        test_request("0 fill");
+    while (atomic_load(&alarm_buffer.waiting) == 0)
+        nanosleep(&pause, NULL);
+
+    // Both shards, whichever alarm thread is blocked.
+    for (i = 0; i < alarm_shard_count; i++)
+    {
+        alarm_id = test_request("10s blocked");
+        CHECK(alarm_id > 0);
+        snprintf(line, sizeof(line), "Cancel %d", alarm_id);
+        CHECK(test_request(line) == alarm_id);
+    }
+    alarm(0);
+    CHECK(atomic_load(&alarm_buffer.full) > full);
+    status = pthread_mutex_unlock(&lateness_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock lateness mutex");
+    fprintf(test_report, "block_unlocked\n");
+}
+
+#define DROP_PRODUCERS 4       // alarm threads sharing the buffer
+#define DROP_ALARMS 50000       // alarms each of them pushes
+#define DROP_SLOTS 64           // small, so it is nearly always full
+
+static circular_buffer_t drop_buffer;
+static atomic_int drop_pushing;
+static unsigned char drop_seen[DROP_PRODUCERS * DROP_ALARMS];
+
+static void *drop_producer(void *arg)
+{
+    alarm_t *batch[EXPIRE_BATCH];
+    unsigned int seed = (unsigned int)(intptr_t)arg;
+    int base = (int)(intptr_t)arg * DROP_ALARMS;
+    int next, count, i;
+
+    for (next = 0; next < DROP_ALARMS; next += count)
+    {
+        count = 1 + rand_r(&seed) % EXPIRE_BATCH;
+        if (count > DROP_ALARMS - next)
+            count = DROP_ALARMS - next;
+        for (i = 0; i < count; i++)
+        {
+            batch[i] = alarm_alloc();
+            batch[i]->alarm_id = base + next + i;
+            batch[i]->periodic = 0;
+        }
+        buffer_push(&drop_buffer, batch, count);
+    }
+    atomic_fetch_sub(&drop_pushing, 1);
+    return NULL;
+}
+
+/*
+ * With "-r drop-oldest", the alarm threads take from the buffer as
+ * the consumer does, so slots come free out of order. Several
+ * producers push through a small buffer while this thread consumes;
+ * every alarm must come out exactly once, or be counted dropped.
+ */
+static void test_drop_oldest(void)
+{
+    alarm_t *batch[CONSUMER_BATCH];
+    pthread_t thread[DROP_PRODUCERS];
+    long received = 0;
+    size_t count, i;
+    int status, index, last;
+
+    buffer_policy = BUFFER_DROP_OLDEST;
+    buffer_init(&drop_buffer, DROP_SLOTS, DROP_PRODUCERS);
+    atomic_store(&drop_pushing, DROP_PRODUCERS);
+    for (index = 0; index < DROP_PRODUCERS; index++)
+    {
+        status = pthread_create(&thread[index], NULL, drop_producer,
+                                (void *)(intptr_t)index);
+        if (status != 0)
+            err_abort(status, "Create drop producer");
+    }
+    alarm(60);
+    do
+    {
+        last = atomic_load(&drop_pushing) == 0;
+        while ((count = buffer_get(&drop_buffer, batch, CONSUMER_BATCH)) > 0)
+            for (i = 0; i < count; i++)
+            {
+                CHECK(batch[i]->alarm_id >= 0
+                      && batch[i]->alarm_id < DROP_PRODUCERS * DROP_ALARMS);
+                CHECK(drop_seen[batch[i]->alarm_id]++ == 0);
+                received++;
+                alarm_free(batch[i]);
+            }
+        sched_yield();
+    } while (!last);
+    alarm(0);
+    for (index = 0; index < DROP_PRODUCERS; index++)
+    {
+        status = pthread_join(thread[index], NULL);
+        if (status != 0)
+            err_abort(status, "Join drop producer");
+    }
+    CHECK(atomic_load(&drop_buffer.dropped) > 0);
+    CHECK(received + atomic_load(&drop_buffer.dropped)
+          == DROP_PRODUCERS * DROP_ALARMS);
+    buffer_policy = BUFFER_BLOCK;
+    fprintf(test_report, "drop_oldest\n");
+}
+
+/*
+ * Carry out a command as a socket client and return its reply,
+ * which the caller frees.
+ */
+static char *test_client(const char *line)
+{
+    server_client_t *client;
+    char *reply;
+
+    client = (server_client_t *)calloc(1, sizeof(server_client_t));
+    CHECK(client != NULL);
+    server_request(client, line, line + strlen(line));
+    server_append(client, "", 1);
+    reply = client->out;
+    free(client);
+    return reply;
+}
+
+/*
+ * Shift range may not move a deadline before now: a periodic alarm
+ * shifted far back fires once, at once, and is next displayed a
+ * period later, not in a burst of missed periods. List range and
+ * Cancel range reach it on its display list, and a socket client
+ * gets the listed lines before the count.
+ */
+static void test_range_periodic(void)
+{
+    struct timespec pause = {0, 1000000};
+    alarm_display_t *display;
+    alarm_t *listed;
+    alarm_time_t start, due = 0;
+    char *reply;
+    int alarm_id;
+
+    start = alarm_now();
+    alarm_id = test_request("Periodic 10s rangetest");
+    CHECK(alarm_id > 0);
+    reply = test_client("Shift range * * -50s rangetest");
+    CHECK(strcmp(reply, "OK 1\n") == 0);
+    free(reply);
+
+    // Wait for it to fire and reach its display list.
+    display = display_of(alarm_id);
+    alarm(10);
+    while (due == 0)
+    {
+        display_lock(display);
+        listed = index_get(&display->index, alarm_id);
+        if (listed != NULL)
+            due = listed->scheduled_time;
+        display_unlock(display);
+        if (due == 0)
+            nanosleep(&pause, NULL);
+    }
+    alarm(0);
+    CHECK(due >= start + 10 * NSEC_PER_SEC);
+
+    reply = test_client("List range * * rangetest");
+    CHECK(strncmp(reply, "Alarm(", 6) == 0);
+    CHECK(strstr(reply, ": rangetest\nOK 1\n") != NULL);
+    free(reply);
+    reply = test_client("Cancel range * * rangetest");
+    CHECK(strcmp(reply, "OK 1\n") == 0);
+    free(reply);
+    display_lock(display);
+    CHECK(index_get(&display->index, alarm_id) == NULL);
+    display_unlock(display);
+    fprintf(test_report, "range_periodic\n");
+}
+
+/*
+ * A socket client asking for "Pool" gets the counters, not just
+ * the count.
+ */
+static void test_client_pool(void)
+{
+    char *reply;
+
+    reply = test_client("Pool");
+    CHECK(strncmp(reply, "Pool: ", 6) == 0);
+    CHECK(strstr(reply, " in use, high-water ") != NULL);
+    CHECK(strstr(reply, "\nOK 0\n") != NULL);
+    free(reply);
+    fprintf(test_report, "client_pool\n");
+}
+
+/*
+ * Append the records for a change to alarm "alarm_id" to a log file,
+ * as the WAL thread would. "due" is on CLOCK_REALTIME.
+ */
+static void test_wal_put(int fd, int type, int alarm_id, int periodic,
+                         alarm_time_t interval, alarm_time_t due, const char *message)
+{
+    wal_record_t record[WAL_PARTS];
+    alarm_t saved;
+    size_t count;
+
+    memset(&saved, 0, sizeof(saved));
+    saved.alarm_id = alarm_id;
+    saved.periodic = periodic;
+    saved.interval = interval;
+    saved.message = message_intern(message, strlen(message));
+    count = wal_encode(record, type, &saved, due);
+    wal_write(fd, record, count * sizeof(wal_record_t));
+    message_release(saved.message);
+}
+
+static int test_wal_open_segment(int64_t segment)
+{
+    char path[4096];
+    int fd;
+
+    wal_path(path, sizeof(path), segment);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        errno_abort("Create test log segment");
+    return fd;
+}
+
+static int test_wal_exists(int64_t segment)
+{
+    char path[4096];
+
+    wal_path(path, sizeof(path), segment);
+    return access(path, F_OK) == 0;
+}
+
+/*
+ * Recovery from a log directory: a segment folded into the snapshot,
+ * a stale copy of it that an interrupted fold left behind, and a
+ * segment written since. Fired and cancelled alarms stay gone, a
+ * changed one comes back changed, and an overdue periodic one moves
+ * on to the next point of its grid. Runs last: it turns logging on.
+ */
+static void test_wal_recover(void)
+{
+    char dir[] = "/tmp/alarm_test.XXXXXX", text[201], path[4096];
+    struct timespec realtime, pause = {0, 1000000};
+    struct stat info;
+    alarm_shard_t *shard;
+    alarm_t *found;
+    alarm_time_t start, wall, due = 0, interval = 0;
+    int fd, periodic = 0, i;
+
+    CHECK(mkdtemp(dir) != NULL);
+    wal_dir = dir;
+    if (clock_gettime(CLOCK_REALTIME, &realtime) != 0)
+        errno_abort("Get real time");
+    start = alarm_now();
+    wall = (alarm_time_t)realtime.tv_sec * NSEC_PER_SEC + realtime.tv_nsec;
+    memset(text, 'x', sizeof(text) - 1);
+    text[sizeof(text) - 1] = '\0';
+
+    fd = test_wal_open_segment(1);
+    test_wal_put(fd, WAL_INSERT, 100001, 0, 60 * NSEC_PER_SEC, wall + 60 * NSEC_PER_SEC, "gone");
+    test_wal_put(fd, WAL_INSERT, 100002, 1, 10 * NSEC_PER_SEC, wall - 25 * NSEC_PER_SEC, text);
+    test_wal_put(fd, WAL_INSERT, 100003, 0, 60 * NSEC_PER_SEC, wall + 60 * NSEC_PER_SEC, "before");
+    test_wal_put(fd, WAL_CHANGE, 100003, 0, 30 * NSEC_PER_SEC, wall + 30 * NSEC_PER_SEC, "after");
+    test_wal_put(fd, WAL_CANCEL, 100001, 0, 0, 0, "");
+    close(fd);
+    wal_compact(1);
+    CHECK(test_wal_exists(-1) && !test_wal_exists(1));
+
+    // The fold renamed its snapshot into place but did not get to unlink.
+    fd = test_wal_open_segment(1);
+    test_wal_put(fd, WAL_INSERT, 100009, 0, 60 * NSEC_PER_SEC, wall + 60 * NSEC_PER_SEC, "stale");
+    close(fd);
+    fd = test_wal_open_segment(2);
+    test_wal_put(fd, WAL_INSERT, 100004, 0, NSEC_PER_SEC, wall + NSEC_PER_SEC, "fired");
+    test_wal_put(fd, WAL_DONE, 100004, 0, 0, 0, "");
+    test_wal_put(fd, WAL_INSERT, 100005, 0, 60 * NSEC_PER_SEC, wall + 60 * NSEC_PER_SEC, "kept");
+    close(fd);
+
+    wal_open();
+    CHECK(!test_wal_exists(1) && test_wal_exists(3));
+    CHECK(atomic_load(&next_alarm_id) > 100005);
+    for (i = 100001; i <= 100009; i++)
+    {
+        shard = shard_of(i);
+        shard_lock(shard);
+        found = store_find(&shard->store, i);
+        CHECK((found != NULL) == (i == 100002 || i == 100003 || i == 100005));
+        if (i == 100002)
+        {
+            periodic = found->periodic;
+            interval = found->interval;
+            due = found->scheduled_time;
+            CHECK(strcmp(found->message->text, text) == 0);
+        }
+        if (i == 100003)
+            CHECK(strcmp(found->message->text, "after") == 0);
+        shard_unlock(shard);
+    }
+    CHECK(periodic && interval == 10 * NSEC_PER_SEC);
+    CHECK(due > start && due <= alarm_now() + 10 * NSEC_PER_SEC);
+
+    // What happens now goes to the new segment.
+    CHECK(test_request("Cancel 100002") == 100002);
+    CHECK(test_request("Cancel 100003") == 100003);
+    CHECK(test_request("Cancel 100005") == 100005);
+    wal_sync();
+    wal_path(path, sizeof(path), 3);
+    CHECK(stat(path, &info) == 0 && info.st_size == 3 * sizeof(wal_record_t));
+
+    // wal_open() has the snapshot thread fold in what it recovered.
+    alarm(10);
+    while (test_wal_exists(2))
+        nanosleep(&pause, NULL);
+    alarm(0);
+    unlink(path);
+    wal_path(path, sizeof(path), -1);
+    unlink(path);
+    rmdir(dir);
+    fprintf(test_report, "wal_recover\n");
+}
+
+int main(void)
+{
+    int null_fd;
+
+    test_report = fdopen(dup(STDOUT_FILENO), "w");
+    null_fd = open("/dev/null", O_WRONLY);
+    if (test_report == NULL || null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0)
+        errno_abort("Redirect stdout");
+    close(null_fd);
+    setvbuf(test_report, NULL, _IONBF, 0);
+
+    initialize_alarm_system(&alarm_backends[0], 2, 1, 1);
+    start_alarm_threads();
+
+    test_periodic_zero_delay();
+    test_store_backends();
+    test_range_last();
+    test_block_unlocked();
+    test_drop_oldest();
+    test_range_periodic();
+    test_client_pool();
+    test_wal_recover();
+    fprintf(test_report, "all tests passed\n");
+    return 0;
+}